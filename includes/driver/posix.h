@@ -7,6 +7,48 @@ size_t posix_stream_device_size();
 
 int posix_get_stream_device(struct BlockDevice *device, const char* filename, unsigned int blocksize);
 
-int posix_create_stream_device(struct BlockDevice *device, const char* filename, uint16_t blocksize, uint32_t count);
+/**
+ * Creates an image of count sectors and opens it as a stream device. The
+ * image is sparse, unless zero is set then every sector is written.
+ *
+ * @param device    Memory of at least posix_stream_device_size bytes
+ * @param filename  The image, replaced when it exists
+ * @param blocksize Number of bytes per sector
+ * @param count     Number of sectors
+ * @param zero      Non zero to write zeros to every sector
+ * @return 1 on success
+ */
+int posix_create_stream_device(struct BlockDevice *device, const char* filename, uint16_t blocksize, uint32_t count, int zero);
+
+size_t posix_file_device_size();
+
+/**
+ * Opens an image with positional reads and writes on a file descriptor, it
+ * has no position of its own so threads can share it. With direct the page
+ * cache is bypassed, the device then asks for memory aligned to a page and
+ * copies what isn't. Sectors have to be a multiple of the logical block size
+ * of the disk for that. Submitted requests go through aio and are completed
+ * with BLOCK_DEVICE_WAIT.
+ *
+ * @param device    Memory of at least posix_file_device_size bytes
+ * @param filename  The image, which has to exist
+ * @param blocksize Number of bytes per sector
+ * @param direct    Non zero to open it with O_DIRECT
+ * @return 1 on success
+ */
+int posix_get_file_device(struct BlockDevice *device, const char* filename, unsigned int blocksize, int direct);
+
+size_t posix_mapped_device_size();
+
+/**
+ * Maps an existing image into memory, reads and writes become copies. The
+ * image keeps its size, writes past the end fail.
+ *
+ * @param device    Memory of at least posix_mapped_device_size bytes
+ * @param filename  The image
+ * @param blocksize Number of bytes per sector
+ * @return 1 on success
+ */
+int posix_get_mapped_device(struct BlockDevice *device, const char* filename, unsigned int blocksize);
 
 #endif
\ No newline at end of file
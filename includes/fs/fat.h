@@ -25,6 +25,18 @@ struct FATCreateParams {
     uint8_t volumeLabel[11];
 }  __attribute__((__packed__));
 
+/**
+ * A file that the defragmenter moves to a run of free clusters
+ */
+struct FATDefragMove {
+    uint32_t directory;
+    uint32_t sector;
+    uint32_t offset;
+    uint32_t cluster;
+    uint32_t length;
+    uint32_t target;
+};
+
 /**
  * Uses the information in the header to create a new filesystem on the device
  * 
@@ -34,6 +46,36 @@ struct FATCreateParams {
  */
 int fat_create(struct FATContext *ctx, size_t size, const struct BlockDevice *device, struct FATCreateParams *parameters);
 
+/**
+ * Set the value in the FAT of a cluster. When the table has been expanded only
+ * the expanded table is updated until it's flushed.
+ * 
+ * @param ctx   The context
+ * @param index The cluster index to set the next entry of
+ * @param next  The value of the next cluster or a EOC mark
+ * @return FAT_SUCCESS on success
+ */
+int fat_set_next_cluster(struct FATContext *ctx, uint32_t index, uint32_t next);
+
+/**
+ * Marks sectors of the table as changed, so they're written by the next
+ * flush. Only needed when the table is changed without fat_set_next_cluster.
+ * 
+ * @param ctx       The context
+ * @param sector    Index of the first sector within the table
+ * @param count     Number of sectors
+ */
+void fat_mark_table_dirty(struct FATContext *ctx, uint32_t sector, uint32_t count);
+
+/**
+ * Writes the sectors of the table that changed to all FAT copies on the
+ * device, sectors that follow each other in a single write per copy
+ * 
+ * @param ctx   The context
+ * @return FAT_SUCCESS on success
+ */
+int fat_flush_table(struct FATContext *ctx);
+
 /**
  * Set the reserved sectors with the new content
  * 
@@ -45,4 +87,145 @@ int fat_create(struct FATContext *ctx, size_t size, const struct BlockDevice *de
  */
 int fat_set_reserved(struct FATContext *ctx, uint32_t startIndex, uint32_t endIndex, const void *source, size_t size);
 
-#endif
\ No newline at end of file
+/**
+ * Size needed for a bitmap with a bit for every cluster
+ * 
+ * @param ctx   The context
+ * @return Number of bytes needed
+ */
+size_t fat_free_map_size(struct FATContext *ctx);
+
+/**
+ * Builds a bitmap of the free clusters from the FAT, once enabled it's kept
+ * up to date by fat_set_next_cluster.
+ * 
+ * @param ctx   The context
+ * @param map   Memory of at least fat_free_map_size bytes
+ * @param size  Size of the memory
+ * @return FAT_SUCCESS on success
+ */
+int fat_enable_free_map(struct FATContext *ctx, uint32_t *map, size_t size);
+
+/**
+ * Counts the free clusters in the bitmap
+ * 
+ * @param ctx   The context
+ * @return Number of free clusters
+ */
+uint32_t fat_count_free(struct FATContext *ctx);
+
+/**
+ * Finds the first free cluster from start, wrapping around at the end
+ * 
+ * @param ctx   The context
+ * @param start Cluster index to start searching at
+ * @return The cluster index or 0 when there are no free clusters
+ */
+uint32_t fat_find_free(struct FATContext *ctx, uint32_t start);
+
+/**
+ * Finds the first run of free clusters from start that is at least length long
+ * 
+ * @param ctx       The context
+ * @param start     Cluster index to start searching at
+ * @param length    Number of clusters needed
+ * @return The first cluster index of the run or 0 when not found
+ */
+uint32_t fat_find_free_run(struct FATContext *ctx, uint32_t start, uint32_t length);
+
+/**
+ * Finds the smallest run of free clusters that is at least length long, when
+ * there is none the largest run is returned instead. Searching starts at the
+ * hint and stops early at a run of exactly the length.
+ * 
+ * @param ctx       The context
+ * @param start     Cluster index to start searching at, like the next free hint
+ * @param length    Number of clusters needed
+ * @param runLength Receives the length of the run that was found
+ * @return The first cluster index of the run or 0 when there are no free clusters
+ */
+uint32_t fat_find_best_run(struct FATContext *ctx, uint32_t start, uint32_t length, uint32_t *runLength);
+
+/**
+ * Sets where the time of new and changed entries comes from. Without a clock
+ * they keep the date and time of 1980-01-01 00:00:00.
+ * 
+ * @param ctx   The context
+ * @param clock Fills in the current date and time
+ */
+void fat_set_clock(struct FATContext *ctx, void (*clock)(struct FATDate *date, struct FATTime *time));
+
+/**
+ * Creates the file or replaces its content. The parent directory must exist,
+ * a directory that is full gets another cluster unless it's the root of
+ * FAT12 or FAT16.
+ * 
+ * @param ctx   The context
+ * @param path  Path of the file
+ * @param data  The content
+ * @param size  Size of the content in bytes
+ * @return FAT_SUCCESS on success
+ */
+int fat_store_file(struct FATContext *ctx, const char *path, const void *data, size_t size);
+
+/**
+ * Adds the data to the end of the file, the file is created when it doesn't
+ * exist yet
+ * 
+ * @param ctx   The context
+ * @param path  Path of the file
+ * @param data  The content to add
+ * @param size  Size of the content in bytes
+ * @return FAT_SUCCESS on success
+ */
+int fat_append_file(struct FATContext *ctx, const char *path, const void *data, size_t size);
+
+/**
+ * Changes the size of the file, the clusters past the new size are freed and
+ * a file that grows is filled with zeros
+ * 
+ * @param ctx   The context
+ * @param path  Path of the file
+ * @param size  The new size in bytes
+ * @return FAT_SUCCESS on success
+ */
+int fat_truncate_file(struct FATContext *ctx, const char *path, size_t size);
+
+/**
+ * Removes the file and frees its clusters, the long name entries in front
+ * of it are deleted too. Directories can't be removed.
+ * 
+ * @param ctx   The context
+ * @param path  Path of the file
+ * @return FAT_SUCCESS on success
+ */
+int fat_remove_file(struct FATContext *ctx, const char *path);
+
+/**
+ * Size needed for a defragmentation plan of count files
+ * 
+ * @param count Number of files that are moved in a single pass
+ * @return Number of bytes needed
+ */
+size_t fat_defrag_plan_size(uint32_t count);
+
+/**
+ * Moves every fragmented file to a run of free clusters that fits it whole.
+ * Each pass plans as many files as the plan holds, copies their clusters in
+ * chunks as large as the buffer and writes the table before the entries are
+ * changed and the old chains are freed. Directories stay where they are.
+ * Files are never moved out of the way, so a file stays fragmented when no
+ * free run is as long as it. Requires the free map to be enabled.
+ * 
+ * @param ctx           The context
+ * @param plan          Memory for the plan, see fat_defrag_plan_size
+ * @param planSize      Size of the plan in bytes
+ * @param buffer        Buffer for copying, at least a cluster
+ * @param bufferSize    Size of the buffer in bytes
+ * @param moved         Receives the number of files moved
+ * @param fragmented    Receives the number of files left fragmented
+ * @return FAT_SUCCESS on success
+ */
+int fat_defragment(struct FATContext *ctx, struct FATDefragMove *plan, size_t planSize, void *buffer, size_t bufferSize, uint32_t *moved, uint32_t *fragmented);
+
+#endif
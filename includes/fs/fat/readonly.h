@@ -2,6 +2,8 @@
 #define FS_FAT_READONLY_H
 
 #include <fs/fat/structure.h>
+#include <io/stream.h>
+#include <io/queue.h>
 
 #define FAT_SUCCESS		             0
 #define FAT_ERROR		            -1
@@ -21,9 +23,31 @@
  */
 int fat_init_context(struct FATContext *ctx, size_t size, const struct BlockDevice *device);
 
+/**
+ * Decodes a FAT12 table once into an array of 16 bit entries, so walking a
+ * chain no longer needs the unaligned load, shift and mask. It requires the
+ * table to be loaded in memory as a whole, and takes the space for the array
+ * from the buffer.
+ * 
+ * @param ctx   The context
+ * @return FAT_SUCCESS when the table has been expanded
+ */
+int fat_expand_table(struct FATContext *ctx);
+
 #define FAT12_EOC 0x0FF8
 #define FAT16_EOC 0xFFF8
 #define FAT32_EOC 0x0FFFFFF8
+#define FAT32_MASK 0x0FFFFFFF
+
+/**
+ * Get a sector of the FAT, from the table in memory or through the pages. A
+ * page that was changed is written to all copies before it's reused.
+ * 
+ * @param ctx       The context
+ * @param sector    Index of the sector within the table
+ * @return Pointer to the sector or 0 when it couldn't be read
+ */
+void *fat_table_sector(struct FATContext *ctx, uint32_t sector);
 
 /**
  * To get the next cluster of a given cluster
@@ -54,6 +78,82 @@ int fat_is_eoc(struct FATContext *ctx, uint32_t index);
  */
 size_t fat_read_cluster(struct FATContext *ctx, uint32_t index, void *dst, size_t size);
 
+/**
+ * Collects the cluster chain into runs of contiguous clusters. It stops when the
+ * chain ends or the extents array is full, in which case cluster is set to the
+ * first cluster not yet collected so the call can be repeated.
+ * 
+ * @param ctx       The context
+ * @param cluster   Pointer to the cluster to start at, receives the next cluster
+ * @param extents   Array to store the extents in
+ * @param size      Number of extents that fit in the array
+ * @return The number of extents stored
+ */
+int32_t fat_get_extents(struct FATContext *ctx, uint32_t *cluster, struct FATExtent *extents, int32_t size);
+
+/**
+ * Read the contents of an extent. All whole clusters are read with a single
+ * device read straight into the dst buffer.
+ * 
+ * @param ctx       The context
+ * @param extent    The extent to read
+ * @param dst       The buffer to copy the contents to
+ * @param size      Number of bytes to read into the dst buffer
+ * @return The number of bytes read
+ */
+size_t fat_read_extent(struct FATContext *ctx, const struct FATExtent *extent, void *dst, size_t size);
+
+/**
+ * Read the contents of a list of extents one after the other. The whole
+ * clusters of several extents are read with a single vectored read, when the
+ * dst buffer suits the alignment of the device.
+ * 
+ * @param ctx       The context
+ * @param extents   The extents to read
+ * @param count     Number of extents
+ * @param dst       The buffer to copy the contents to
+ * @param size      Number of bytes to read into the dst buffer
+ * @return The number of bytes read
+ */
+size_t fat_read_extents(struct FATContext *ctx, const struct FATExtent *extents, int32_t count, void *dst, size_t size);
+
+/**
+ * Turns the first segment of the path into the 11 bytes of a short entry name
+ * 
+ * @param path  A null-delimited string with a path
+ * @param name  11 bytes to store the name in
+ * @return The path after the segment or 0 when it's not a valid short name
+ */
+const char *fat_parse_segment(const char *path, uint8_t *name);
+
+/**
+ * Keep an index of the entries of the directories that are searched, so the
+ * next lookup in the same directory doesn't have to scan it again.
+ * 
+ * @param ctx   The context
+ * @param size  Number of bytes of the buffer the index may use
+ * @return FAT_SUCCESS when enabled
+ */
+int fat_enable_directory_index(struct FATContext *ctx, size_t size);
+
+/**
+ * Remember the entries of resolved paths, so a lookup can start from the
+ * longest part of the path that has been resolved before.
+ * 
+ * @param ctx   The context
+ * @param count Number of paths to remember
+ * @return FAT_SUCCESS when enabled
+ */
+int fat_enable_path_cache(struct FATContext *ctx, uint32_t count);
+
+/**
+ * Must be called when the entries of a directory have been changed
+ * 
+ * @param ctx       The context
+ * @param cluster   First cluster of the directory, 0 for the root directory
+ */
+void fat_invalidate_directory(struct FATContext *ctx, uint32_t cluster);
+
 /**
  * When it find the file it will return it entry, when it has a long name and size would
  * fit the name, the entries will be filled with does entries, otherwise it will return
@@ -64,8 +164,108 @@ size_t fat_read_cluster(struct FATContext *ctx, uint32_t index, void *dst, size_
  *  @param entries 	Pointer to single entry or array of entries
  *  @param size 	Size available in the entries
  *  @param path 	A null-delimited string with the short entry path to be found
- *  @return Number of entries found
+ *  @return Number of entries found, or FAT_ERR_FAILED_READ when a directory couldn't be read
  */
 int32_t fat_find_file(struct FATContext *ctx, struct FATDirectoryEntry *entries, int32_t size, const char *path);
 
-#endif
\ No newline at end of file
+/**
+ * Finds the entry of a file, unlike fat_find_file it doesn't list directories
+ * 
+ * @param ctx   The context
+ * @param entry Entry to fill
+ * @param path  A null-delimited string with the short entry path of the file
+ * @return 1 when found, 0 when not found or when it's a directory and
+ *         FAT_ERR_FAILED_READ when a directory couldn't be read
+ */
+int fat_find_entry(struct FATContext *ctx, struct FATDirectoryEntry *entry, const char *path);
+
+/**
+ * Size needed to open a directory, which includes room for one sector
+ * 
+ * @param ctx   The context
+ * @return Number of bytes needed
+ */
+size_t fat_directory_size(struct FATContext *ctx);
+
+/**
+ * Opens a directory to go through its entries one by one
+ * 
+ * @param ctx       The context
+ * @param directory Memory of at least fat_directory_size bytes
+ * @param path      A null-delimited string with the short entry path of the directory
+ * @return FAT_SUCCESS when opened, FAT_ERROR when not found or not a directory
+ *         and FAT_ERR_FAILED_READ when a directory couldn't be read
+ */
+int fat_open_directory(struct FATContext *ctx, struct FATDirectory *directory, const char *path);
+
+/**
+ * Reads the next entry of the directory, long name and deleted entries are
+ * skipped
+ * 
+ * @param ctx       The context
+ * @param directory The opened directory
+ * @param entry     Entry to fill
+ * @return 1 when an entry is read, 0 at the end of the directory
+ */
+int fat_read_directory(struct FATContext *ctx, struct FATDirectory *directory, struct FATDirectoryEntry *entry);
+
+/**
+ * Size needed to open a file as a stream
+ * 
+ * @return Number of bytes needed
+ */
+size_t fat_file_stream_size();
+
+/**
+ * Opens a file as a stream. The stream remembers the cluster it is at, so
+ * reading on from the current position doesn't walk the chain again. The
+ * context must stay around until the stream is closed.
+ * 
+ * @param ctx       The context
+ * @param stream    Memory of at least fat_file_stream_size bytes
+ * @param path      A null-delimited string with the short entry path of the file
+ * @return FAT_SUCCESS when opened, FAT_ERROR when not found or a directory
+ *         and FAT_ERR_FAILED_READ when a directory couldn't be read
+ */
+int fat_open_file(struct FATContext *ctx, stream_t *stream, const char *path);
+
+/**
+ * Gives an opened file memory to remember the cluster of every interval
+ * clusters. They are filled in while the chain is walked, after which a seek
+ * only walks from the closest one.
+ * 
+ * @param stream        The stream opened with fat_open_file
+ * @param checkpoints   Memory for count clusters
+ * @param count         Number of checkpoints to keep
+ * @param interval      Number of clusters between two checkpoints
+ * @return FAT_SUCCESS when enabled
+ */
+int fat_file_stream_checkpoints(stream_t *stream, uint32_t *checkpoints, uint32_t count, uint32_t interval);
+
+/**
+ * Gives an opened file memory to read ahead in. When a read of part of a
+ * cluster, or of less then the window, continues where the last one ended,
+ * the clusters after it are prefetched with as few device reads as the chain
+ * allows. The number of
+ * clusters grows while all of them get used and shrinks when most are
+ * skipped. The buffer must suit the alignment of the device.
+ * 
+ * @param stream    The stream opened with fat_open_file
+ * @param buffer    Memory to keep the prefetched clusters in
+ * @param size      Size of the memory, at least a cluster
+ * @return FAT_SUCCESS when enabled
+ */
+int fat_file_stream_readahead(stream_t *stream, void *buffer, size_t size);
+
+/**
+ * Sends the device reads of an opened file through a queue. The pieces of the
+ * chain a read or a prefetch needs are then all submitted before waiting for
+ * them, so a device that completes asynchronously works on them at once.
+ * 
+ * @param stream    The stream opened with fat_open_file
+ * @param queue     A queue for the device of the context, 0 to read directly
+ * @return FAT_SUCCESS when set
+ */
+int fat_file_stream_queue(stream_t *stream, struct BlockQueue *queue);
+
+#endif
@@ -36,6 +36,25 @@ struct FATExtendedHeader {
     uint8_t reserved[12];
 } __attribute__((__packed__));
 
+/**
+ * The FSInfo sector of FAT32, its counts are only hints and may be 0xFFFFFFFF
+ * when unknown
+ */
+struct FATFileSystemInfo {
+    uint32_t leadSignature;
+    uint8_t reserved0[480];
+    uint32_t structureSignature;
+    uint32_t freeClusters;
+    uint32_t nextFree;
+    uint8_t reserved1[12];
+    uint32_t trailSignature;
+} __attribute__((__packed__));
+
+#define FAT_FSINFO_LEAD_SIGNATURE       0x41615252
+#define FAT_FSINFO_STRUCTURE_SIGNATURE  0x61417272
+#define FAT_FSINFO_TRAIL_SIGNATURE      0xAA550000
+#define FAT_FSINFO_UNKNOWN              0xFFFFFFFF
+
 struct FATBootSector {
     uint8_t driveNumber;
     uint8_t reserved;
@@ -69,6 +88,47 @@ enum FATType {
     FAT32 = 040,
 };
 
+/**
+ * A sector of the FAT loaded on demand, when the table is too large to keep
+ * in memory as a whole
+ */
+struct FATTablePage {
+    uint32_t sector;
+    uint32_t lastUsed;
+    // Changed and not yet written to the copies on the device
+    uint32_t dirty;
+    void *data;
+};
+
+#define FAT_TABLE_PAGES     8
+#define FAT_PAGE_EMPTY      0xFFFFFFFF
+
+/**
+ * Where an entry of a directory is found on the device, by hash of its name
+ */
+struct FATIndexEntry {
+    uint32_t directory;
+    uint32_t sector;
+    uint16_t offset;
+    uint16_t hash;
+};
+
+#define FAT_INDEX_DIRECTORIES 16
+
+/**
+ * Hash table of the entries of the directories that have been scanned
+ */
+struct FATDirectoryIndex {
+    uint32_t numberOfSlots;
+    uint32_t used;
+    uint32_t numberOfDirectories;
+    uint32_t directories[FAT_INDEX_DIRECTORIES];
+    struct FATIndexEntry *slots;
+};
+
+struct FATDate;
+struct FATTime;
+
 struct FATContext {
     size_t size;
     const struct BlockDevice *device;
@@ -80,11 +140,33 @@ struct FATContext {
     uint32_t startOfRootDirectory;
     uint32_t startOfData;
     uint32_t numberOfClusters;
+    uint32_t sectorsPerFat;
+    uint32_t freeClusters;
+    uint32_t nextFree;
     void *fat;
+    uint16_t *expanded;
+    struct FATTablePage *pages;
+    uint32_t numberOfPages;
+    uint32_t pageClock;
+    struct FATDirectoryIndex *index;
+    struct FATPathCache *paths;
+    uint32_t *freeMap;
+    // A bit for every sector of the table in memory that has changed
+    uint32_t *dirty;
+    // Gives the current date and time for the entries that are written
+    void (*clock)(struct FATDate *date, struct FATTime *time);
     void *buffer;
     size_t bufferSize;
 };
 
+/**
+ * A run of clusters that follow each other directly on the device
+ */
+struct FATExtent {
+    uint32_t cluster;
+    uint32_t length;
+};
+
 struct FATTime {
     uint16_t seconds : 5;
     uint16_t minutes : 6;
@@ -142,4 +224,48 @@ struct FATDirectoryEntry {
     uint32_t fileSize;
 } __attribute__((__packed__));
 
+/**
+ * Where the reading of a directory is at, it's the root directory when the
+ * cluster is 0
+ */
+struct FATDirectoryReader {
+    uint32_t clusterIndex;
+    uint32_t sectorCount;
+    uint32_t sectorIndex;
+    uint32_t entriesCount;
+};
+
+/**
+ * An open directory, going through the entries one sector at a time
+ */
+struct FATDirectory {
+    struct FATDirectoryReader reader;
+    uint32_t sector;
+    uint32_t entry;
+    uint32_t ended;
+    void *data;
+};
+
+#define FAT_PATH_DEPTH 8
+
+/**
+ * A resolved path, stored as the short names of its segments
+ */
+struct FATPathEntry {
+    uint8_t names[FAT_PATH_DEPTH * 11];
+    uint32_t depth;
+    uint32_t parent;
+    uint32_t lastUsed;
+    struct FATDirectoryEntry entry;
+};
+
+/**
+ * Paths that have been resolved before, the least recently used one is replaced
+ */
+struct FATPathCache {
+    uint32_t numberOfEntries;
+    uint32_t clock;
+    struct FATPathEntry *entries;
+};
+
 #endif
\ No newline at end of file
@@ -0,0 +1,54 @@
+#ifndef IO_CACHE_H
+#define IO_CACHE_H
+
+#include <io/device.h>
+
+/**
+ * Counters kept by a cache device
+ */
+struct BlockCacheStatistics {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t writeBacks;
+};
+
+/**
+ * Size needed to store a cache device that keeps count sectors of the source
+ *
+ * @param source    The device to cache
+ * @param count     Number of sectors to keep in memory
+ * @return Number of bytes needed
+ */
+size_t block_cache_device_size(const struct BlockDevice *source, uint32_t count);
+
+/**
+ * Wraps a device with a LRU sector cache. All memory it needs comes out of the
+ * memory of the device itself, so the number of sectors is derived from size.
+ * Writes are kept in the cache until evicted or until a BLOCK_DEVICE_FLUSH.
+ * Memory that doesn't suit the alignment of the source goes through the
+ * slots, so the cache itself takes any.
+ *
+ * @param device    Memory to store the cache device in
+ * @param size      Size of the memory
+ * @param source    The device to cache
+ * @return 1 on success
+ */
+int block_cache_get_device(struct BlockDevice *device, size_t size, const struct BlockDevice *source);
+
+/**
+ * Get the device the cache is wrapping
+ *
+ * @param device    The cache device
+ * @return The source device
+ */
+const struct BlockDevice *block_cache_get_source(const struct BlockDevice *device);
+
+/**
+ * Get a copy of the counters of the cache
+ *
+ * @param device        The cache device
+ * @param statistics    Structure to copy the counters into
+ */
+void block_cache_get_statistics(const struct BlockDevice *device, struct BlockCacheStatistics *statistics);
+
+#endif
@@ -6,15 +6,107 @@
 typedef enum BlockDeviceAction {
     BLOCK_DEVICE_OPEN = 1,
     BLOCK_DEVICE_CLOSE = 2,
-    BLOCK_DEVICE_FLUSH = 3
+    BLOCK_DEVICE_FLUSH = 3,
+    // Completes the submitted requests that are done, waits for one when
+    // none of them are yet
+    BLOCK_DEVICE_WAIT = 4
 } bdaction_t;
 
+/**
+ * A transfer handed to a device or a queue. When it's done, done holds the
+ * number of sectors transfered and complete is called.
+ */
+struct BlockRequest {
+    uint32_t index;
+    uint32_t count;
+    void *address;
+    // Non zero to write to the device
+    uint32_t write;
+    uint32_t done;
+    void (*complete)(struct BlockRequest *request);
+    // Left to the one making the request
+    void *data;
+    // Used by the queue the request is in
+    struct BlockRequest *next;
+};
+
+/**
+ * A range of sectors and the memory it's read into or written from
+ */
+struct BlockSegment {
+    uint32_t index;
+    uint32_t count;
+    void *address;
+};
+
 struct BlockDevice {
     size_t size;
     int blockSize;
+    // Required alignment of a buffer to read into or write from directly
+    int alignment;
+    // Returns 1 on success, also for an action the device has nothing to do
+    // for. Flushing a device without a cache of its own succeeds right away.
     int (*action)(const struct BlockDevice*, bdaction_t action);
     uint32_t (*read)(const struct BlockDevice*, uint32_t index, uint32_t count, void *address);
     uint32_t (*write)(const struct BlockDevice*, uint32_t index, uint32_t count, const void *address);
+    // Transfers the segments in order, 0 when the device has no better way
+    // then a read or write for each of them
+    uint32_t (*readv)(const struct BlockDevice*, const struct BlockSegment *segments, uint32_t count);
+    uint32_t (*writev)(const struct BlockDevice*, const struct BlockSegment *segments, uint32_t count);
+    // Starts a request that completes later, 0 when the device only has the
+    // synchronous read and write. The complete callback is called from submit
+    // itself or from a BLOCK_DEVICE_WAIT, never on its own.
+    int (*submit)(const struct BlockDevice*, struct BlockRequest *request);
 };
 
-#endif
\ No newline at end of file
+/**
+ * Reads the segments with a single call when the device can, otherwise one
+ * read for each of them. Stops at the first segment that isn't read whole.
+ *
+ * @param device    The device
+ * @param segments  The segments
+ * @param count     Number of segments
+ * @return Number of sectors read
+ */
+static inline uint32_t block_readv(const struct BlockDevice *device, const struct BlockSegment *segments, uint32_t count) {
+    if (device->readv)
+        return device->readv(device, segments, count);
+
+    uint32_t total = 0;
+    for (uint32_t index = 0; index < count; index++) {
+        uint32_t read = device->read(device, segments[index].index, segments[index].count, segments[index].address);
+
+        total+= read;
+        if (read != segments[index].count)
+            break;
+    }
+
+    return total;
+}
+
+/**
+ * Writes the segments with a single call when the device can, otherwise one
+ * write for each of them. Stops at the first segment that isn't written whole.
+ *
+ * @param device    The device
+ * @param segments  The segments
+ * @param count     Number of segments
+ * @return Number of sectors written
+ */
+static inline uint32_t block_writev(const struct BlockDevice *device, const struct BlockSegment *segments, uint32_t count) {
+    if (device->writev)
+        return device->writev(device, segments, count);
+
+    uint32_t total = 0;
+    for (uint32_t index = 0; index < count; index++) {
+        uint32_t written = device->write(device, segments[index].index, segments[index].count, segments[index].address);
+
+        total+= written;
+        if (written != segments[index].count)
+            break;
+    }
+
+    return total;
+}
+
+#endif
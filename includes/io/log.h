@@ -0,0 +1,67 @@
+#ifndef IO_LOG_H
+#define IO_LOG_H
+
+#include <io/device.h>
+
+/**
+ * Size needed to store a log device that keeps count changed sectors of the
+ * source in memory
+ *
+ * @param source    The device to log the changes of
+ * @param count     Number of changed sectors to keep in memory
+ * @return Number of bytes needed
+ */
+size_t block_log_device_size(const struct BlockDevice *source, uint32_t count);
+
+/**
+ * Prepares a region of the source to hold a log. The last sector of the
+ * region keeps the state of the log, the others the groups of changes.
+ *
+ * @param source    The device
+ * @param start     First sector of the region
+ * @param length    Number of sectors in the region, at least 3
+ * @param buffer    Memory of a sector
+ * @return 1 on success
+ */
+int block_log_format(const struct BlockDevice *source, uint32_t start, uint32_t length, void *buffer);
+
+/**
+ * Writes the groups that were committed but not yet checkpointed to their
+ * place, like after a crash. Nothing is done when there is no log.
+ *
+ * @param source    The device
+ * @param state     The sector with the state of the log, the last of the region
+ * @param buffer    Memory of two sectors
+ * @return Number of groups replayed or -1 when it failed
+ */
+int block_log_replay(const struct BlockDevice *source, uint32_t state, void *buffer);
+
+/**
+ * Wraps a device with a write-ahead log. Writes below the boundary and writes
+ * of a single sector are taken as metadata and kept in memory, reads see
+ * them. On a BLOCK_DEVICE_FLUSH the metadata is consistent, so once enough
+ * changes are gathered they are committed as a group with a single write to
+ * the log. When memory or the log runs out everything is checkpointed to
+ * its place with the sectors sorted, and so is a BLOCK_DEVICE_CLOSE. Other
+ * writes go straight to the source. A log that wasn't checkpointed is
+ * replayed first. The region of the log itself reads as zeros and can't be
+ * written.
+ *
+ * @param device    Memory to store the log device in
+ * @param size      Size of the memory
+ * @param source    The device to log the changes of
+ * @param state     The sector with the state of the log, the last of the region
+ * @param boundary  Writes below this sector are always metadata
+ * @return 1 on success, 0 when there is no log or not enough memory
+ */
+int block_log_get_device(struct BlockDevice *device, size_t size, const struct BlockDevice *source, uint32_t state, uint32_t boundary);
+
+/**
+ * Get the device the log is wrapping
+ *
+ * @param device    The log device
+ * @return The source device
+ */
+const struct BlockDevice *block_log_get_source(const struct BlockDevice *device);
+
+#endif
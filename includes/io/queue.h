@@ -0,0 +1,70 @@
+#ifndef IO_QUEUE_H
+#define IO_QUEUE_H
+
+#include <io/device.h>
+
+struct BlockQueue;
+
+/**
+ * Size needed to store a queue that merges requests of up to count sectors
+ *
+ * @param device    The device the requests go to
+ * @param count     Number of sectors a merged request may span
+ * @return Number of bytes needed
+ */
+size_t block_queue_size(const struct BlockDevice *device, uint32_t count);
+
+/**
+ * Prepares a queue of requests for a device. Requests are only kept until
+ * they're dispatched, the memory of a request must stay around until it's
+ * completed. A request larger then the queue is transfered on its own, so its
+ * memory must suit the alignment of the device.
+ *
+ * @param queue     Memory to store the queue in
+ * @param size      Size of the memory
+ * @param device    The device the requests go to
+ * @return 1 on success
+ */
+int block_queue_init(struct BlockQueue *queue, size_t size, const struct BlockDevice *device);
+
+/**
+ * Adds a request to the queue, nothing is transfered until it's dispatched
+ *
+ * @param queue     The queue
+ * @param request   The request, done is set to 0
+ * @return 1 when queued, 0 when the request is empty
+ */
+int block_queue_submit(struct BlockQueue *queue, struct BlockRequest *request);
+
+/**
+ * Hands the queued requests to the device. Requests of the same direction
+ * with sectors that overlap or follow each other are merged into a single
+ * transfer, though a request never passes an earlier one that touches the
+ * same sectors when either of them writes, or one that is still on its way.
+ * On a device without submit they are transfered with read and write, so
+ * every request is completed when this returns. Otherwise the requests that
+ * had to wait are started by calling it again after a BLOCK_DEVICE_WAIT.
+ *
+ * @param queue     The queue
+ * @return Number of transfers started
+ */
+uint32_t block_queue_dispatch(struct BlockQueue *queue);
+
+/**
+ * Dispatches the queued requests and waits with BLOCK_DEVICE_WAIT until every
+ * one of them is completed
+ *
+ * @param queue     The queue
+ * @return 1 when all are completed, 0 when the device failed to wait
+ */
+int block_queue_finish(struct BlockQueue *queue);
+
+/**
+ * Number of transfers that were started but aren't completed yet
+ *
+ * @param queue     The queue
+ * @return Number of transfers
+ */
+uint32_t block_queue_in_flight(const struct BlockQueue *queue);
+
+#endif
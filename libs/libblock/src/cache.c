@@ -0,0 +1,358 @@
+#include <io/cache.h>
+#include <memory.h>
+
+#define SLOT_NONE   -1
+#define SLOT_VALID  0x01
+#define SLOT_DIRTY  0x02
+
+/**
+ * Bookkeeping of a single cached sector
+ */
+struct BlockCacheSlot {
+    uint32_t index;
+    uint32_t flags;
+    int32_t previous;
+    int32_t next;
+    int32_t chain;
+};
+
+struct BlockCacheDevice {
+    struct BlockDevice device;
+    const struct BlockDevice *source;
+    uint32_t count;
+    uint32_t stride;
+    int32_t head;
+    int32_t tail;
+    struct BlockCacheStatistics statistics;
+    struct BlockCacheSlot *slots;
+    int32_t *table;
+    uint8_t *data;
+};
+
+/**
+ * Distance between the data of two slots, so each of them suits the alignment
+ * of the source
+ */
+static inline uint32_t slot_stride(const struct BlockDevice *source) {
+    if (source->alignment <= 1)
+        return source->blockSize;
+
+    return (source->blockSize + source->alignment - 1) / source->alignment * source->alignment;
+}
+
+/**
+ * Memory needed per cached sector
+ */
+static inline size_t slot_size(const struct BlockDevice *source) {
+    return sizeof(struct BlockCacheSlot) + sizeof(int32_t) + slot_stride(source);
+}
+
+static inline uint8_t *slot_data(struct BlockCacheDevice *cache, int32_t slot) {
+    return cache->data + slot * cache->stride;
+}
+
+static inline int is_aligned(const struct BlockDevice *device, const void *address) {
+    if (device->alignment <= 1)
+        return 1;
+
+    return ((size_t)address % device->alignment) == 0;
+}
+
+/**
+ * Remove a slot from the LRU list
+ */
+static inline void lru_remove(struct BlockCacheDevice *cache, int32_t slot) {
+    struct BlockCacheSlot *entry = cache->slots + slot;
+
+    if (entry->previous != SLOT_NONE) {
+        cache->slots[entry->previous].next = entry->next;
+    } else {
+        cache->head = entry->next;
+    }
+
+    if (entry->next != SLOT_NONE) {
+        cache->slots[entry->next].previous = entry->previous;
+    } else {
+        cache->tail = entry->previous;
+    }
+}
+
+/**
+ * Make the slot the most recently used one
+ */
+static inline void lru_touch(struct BlockCacheDevice *cache, int32_t slot) {
+    if (cache->head == slot)
+        return;
+
+    lru_remove(cache, slot);
+
+    cache->slots[slot].previous = SLOT_NONE;
+    cache->slots[slot].next = cache->head;
+    cache->slots[cache->head].previous = slot;
+    cache->head = slot;
+}
+
+/**
+ * Find the slot holding a sector
+ */
+static inline int32_t lookup(struct BlockCacheDevice *cache, uint32_t index) {
+    int32_t slot = cache->table[index % cache->count];
+
+    while (slot != SLOT_NONE) {
+        if (cache->slots[slot].index == index)
+            return slot;
+
+        slot = cache->slots[slot].chain;
+    }
+
+    return SLOT_NONE;
+}
+
+/**
+ * Remove the slot from its hash chain
+ */
+static inline void detach(struct BlockCacheDevice *cache, int32_t slot) {
+    int32_t *link = cache->table + (cache->slots[slot].index % cache->count);
+
+    while (*link != slot)
+        link = &cache->slots[*link].chain;
+
+    *link = cache->slots[slot].chain;
+}
+
+/**
+ * Write a dirty slot back to the source
+ */
+static inline int write_back(struct BlockCacheDevice *cache, int32_t slot) {
+    struct BlockCacheSlot *entry = cache->slots + slot;
+
+    if ((entry->flags & SLOT_DIRTY) == 0)
+        return 1;
+
+    if (cache->source->write(cache->source, entry->index, 1, slot_data(cache, slot)) != 1)
+        return 0;
+
+    entry->flags&= ~SLOT_DIRTY;
+    cache->statistics.writeBacks++;
+    return 1;
+}
+
+/**
+ * Take the least recently used slot and assign it to a sector
+ */
+static int32_t claim(struct BlockCacheDevice *cache, uint32_t index) {
+    int32_t slot = cache->tail;
+    struct BlockCacheSlot *entry = cache->slots + slot;
+
+    if (entry->flags & SLOT_VALID) {
+        if (!write_back(cache, slot))
+            return SLOT_NONE;
+
+        detach(cache, slot);
+    }
+
+    entry->index = index;
+    entry->flags = SLOT_VALID;
+    entry->chain = cache->table[index % cache->count];
+    cache->table[index % cache->count] = slot;
+
+    lru_touch(cache, slot);
+    return slot;
+}
+
+/**
+ * Forget a claimed slot whose sector couldn't be read
+ */
+static inline void release(struct BlockCacheDevice *cache, int32_t slot) {
+    detach(cache, slot);
+    cache->slots[slot].flags = 0;
+}
+
+/**
+ * Peform close or flush
+ */
+static int block_cache_action(const struct BlockDevice *device, bdaction_t action) {
+    struct BlockCacheDevice *cache = (void*)device;
+
+    switch (action) {
+        case BLOCK_DEVICE_CLOSE:
+        case BLOCK_DEVICE_FLUSH:
+            for (uint32_t slot = 0; slot < cache->count; slot++) {
+                if (!write_back(cache, slot))
+                    return 0;
+            }
+        break;
+        default:
+        break;
+    }
+
+    return cache->source->action(cache->source, action);
+}
+
+/**
+ * Read the given sectors
+ */
+static uint32_t block_cache_read(const struct BlockDevice *device, uint32_t index, uint32_t count, void *address) {
+    struct BlockCacheDevice *cache = (void*)device;
+    uint32_t blockSize = device->blockSize;
+    uint32_t offset = 0;
+
+    while (offset < count) {
+        int32_t slot = lookup(cache, index + offset);
+
+        if (slot != SLOT_NONE) {
+            memory_copy(address + offset * blockSize, slot_data(cache, slot), blockSize);
+            lru_touch(cache, slot);
+            cache->statistics.hits++;
+            offset++;
+            continue;
+        }
+
+        // Gather all following sectors that are missing, so they can be read in one go
+        uint32_t run = 1;
+        while (offset + run < count && lookup(cache, index + offset + run) == SLOT_NONE)
+            run++;
+
+        cache->statistics.misses+= run;
+
+        // Memory that doesn't suit the source is read into the slots, which
+        // do, and copied out of them
+        if (!is_aligned(cache->source, address + offset * blockSize)) {
+            for (uint32_t current = 0; current < run; current++) {
+                if ((slot = claim(cache, index + offset)) == SLOT_NONE)
+                    return offset;
+
+                if (cache->source->read(cache->source, index + offset, 1, slot_data(cache, slot)) != 1) {
+                    release(cache, slot);
+                    return offset;
+                }
+
+                memory_copy(address + offset * blockSize, slot_data(cache, slot), blockSize);
+                offset++;
+            }
+
+            continue;
+        }
+
+        uint32_t read = cache->source->read(cache->source, index + offset, run, address + offset * blockSize);
+        if (read != run)
+            return offset + read;
+
+        // Only the last sectors of a run larger then the cache would survive anyway
+        uint32_t skip = run > cache->count ? run - cache->count : 0;
+        for (uint32_t current = skip; current < run; current++) {
+            if ((slot = claim(cache, index + offset + current)) == SLOT_NONE)
+                return offset + run;
+
+            memory_copy(slot_data(cache, slot), address + (offset + current) * blockSize, blockSize);
+        }
+
+        offset+= run;
+    }
+
+    return count;
+}
+
+/**
+ * Write the given sectors
+ */
+static uint32_t block_cache_write(const struct BlockDevice *device, uint32_t index, uint32_t count, const void *address) {
+    struct BlockCacheDevice *cache = (void*)device;
+    uint32_t blockSize = device->blockSize;
+
+    // A write larger then the whole cache would only push everything out, so
+    // write it through and refresh the sectors we happen to have. Memory that
+    // doesn't suit the source has to go through the slots.
+    if (count >= cache->count && is_aligned(cache->source, address)) {
+        uint32_t written = cache->source->write(cache->source, index, count, address);
+
+        for (uint32_t offset = 0; offset < written; offset++) {
+            int32_t slot = lookup(cache, index + offset);
+            if (slot == SLOT_NONE)
+                continue;
+
+            memory_copy(slot_data(cache, slot), address + offset * blockSize, blockSize);
+            cache->slots[slot].flags&= ~SLOT_DIRTY;
+        }
+
+        return written;
+    }
+
+    for (uint32_t offset = 0; offset < count; offset++) {
+        int32_t slot = lookup(cache, index + offset);
+
+        if (slot == SLOT_NONE) {
+            if ((slot = claim(cache, index + offset)) == SLOT_NONE)
+                return offset;
+        } else {
+            lru_touch(cache, slot);
+        }
+
+        memory_copy(slot_data(cache, slot), address + offset * blockSize, blockSize);
+        cache->slots[slot].flags|= SLOT_DIRTY;
+    }
+
+    return count;
+}
+
+size_t block_cache_device_size(const struct BlockDevice *source, uint32_t count) {
+    // Room to align the data to what the source requires
+    return sizeof(struct BlockCacheDevice) + count * slot_size(source) + source->alignment;
+}
+
+int block_cache_get_device(struct BlockDevice *device, size_t size, const struct BlockDevice *source) {
+    if (size < sizeof(struct BlockCacheDevice) + source->alignment)
+        return 0;
+
+    uint32_t count = (size - sizeof(struct BlockCacheDevice) - source->alignment) / slot_size(source);
+    if (count == 0)
+        return 0;
+
+    struct BlockCacheDevice *cache = (void*)device;
+    cache->device.size      = sizeof(struct BlockCacheDevice);
+    cache->device.blockSize = source->blockSize;
+    cache->device.alignment = 1;
+    cache->device.action    = block_cache_action;
+    cache->device.read      = block_cache_read;
+    cache->device.write     = block_cache_write;
+    cache->device.readv     = 0;
+    cache->device.writev    = 0;
+    cache->device.submit    = 0;
+    cache->source           = source;
+    cache->count            = count;
+    cache->stride           = slot_stride(source);
+    cache->slots            = ((void*)device) + sizeof(struct BlockCacheDevice);
+    cache->table            = (void*)(cache->slots + count);
+    cache->data             = (void*)(cache->table + count);
+
+    if (source->alignment > 1) {
+        size_t misaligned = (size_t)cache->data % source->alignment;
+        if (misaligned)
+            cache->data+= source->alignment - misaligned;
+    }
+
+    memory_set(&cache->statistics, 0, sizeof(struct BlockCacheStatistics));
+
+    // All slots start empty in one long LRU list
+    for (uint32_t slot = 0; slot < count; slot++) {
+        cache->slots[slot].index = 0;
+        cache->slots[slot].flags = 0;
+        cache->slots[slot].previous = slot > 0 ? (int32_t)slot - 1 : SLOT_NONE;
+        cache->slots[slot].next = slot + 1 < count ? (int32_t)slot + 1 : SLOT_NONE;
+        cache->slots[slot].chain = SLOT_NONE;
+        cache->table[slot] = SLOT_NONE;
+    }
+
+    cache->head = 0;
+    cache->tail = count - 1;
+
+    return 1;
+}
+
+const struct BlockDevice *block_cache_get_source(const struct BlockDevice *device) {
+    return ((struct BlockCacheDevice*)device)->source;
+}
+
+void block_cache_get_statistics(const struct BlockDevice *device, struct BlockCacheStatistics *statistics) {
+    memory_copy(statistics, &((struct BlockCacheDevice*)device)->statistics, sizeof(struct BlockCacheStatistics));
+}
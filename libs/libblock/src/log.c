@@ -0,0 +1,501 @@
+#include <io/log.h>
+#include <memory.h>
+
+#define LOG_STATE_MAGIC     0x54534C42
+#define LOG_GROUP_MAGIC     0x50524742
+
+#define SLOT_NONE           -1
+
+/**
+ * The last sector of the region, it tells which groups are in place
+ */
+struct BlockLogState {
+    uint32_t magic;
+    uint32_t start;
+    uint32_t length;
+    uint32_t sequence;
+};
+
+/**
+ * The first sector of a group, followed by a sector for every target
+ */
+struct BlockLogGroup {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t count;
+    uint32_t checksum;
+    uint32_t targets[];
+};
+
+/**
+ * Bookkeeping of a single changed sector
+ */
+struct BlockLogSlot {
+    uint32_t index;
+    uint32_t pending;
+    int32_t chain;
+};
+
+struct BlockLogDevice {
+    struct BlockDevice device;
+    const struct BlockDevice *source;
+    uint32_t count;
+    uint32_t used;
+    uint32_t pending;
+    uint32_t groupSize;
+    uint32_t start;
+    uint32_t state;
+    uint32_t boundary;
+    uint32_t position;
+    uint32_t sequence;
+    struct BlockLogSlot *slots;
+    int32_t *table;
+    uint32_t *order;
+    uint8_t *data;
+    uint8_t *group;
+};
+
+/**
+ * Memory needed per changed sector
+ */
+static inline size_t slot_size(const struct BlockDevice *source) {
+    return sizeof(struct BlockLogSlot) + sizeof(int32_t) + sizeof(uint32_t) + source->blockSize;
+}
+
+/**
+ * Number of targets that fit in the first sector of a group
+ */
+static inline uint32_t max_targets(const struct BlockDevice *source) {
+    return (source->blockSize - sizeof(struct BlockLogGroup)) / sizeof(uint32_t);
+}
+
+static inline uint8_t *slot_data(struct BlockLogDevice *log, int32_t slot) {
+    return log->data + slot * log->device.blockSize;
+}
+
+/**
+ * FNV-1a, to tell a group that was written completely from a torn one
+ */
+static uint32_t checksum(uint32_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+
+    for (size_t index = 0; index < size; index++)
+        hash = (hash ^ bytes[index]) * 16777619;
+
+    return hash;
+}
+
+static int write_state(const struct BlockDevice *source, uint32_t state, uint32_t start, uint32_t sequence, void *buffer) {
+    struct BlockLogState *header = buffer;
+
+    memory_set(buffer, 0, source->blockSize);
+    header->magic = LOG_STATE_MAGIC;
+    header->start = start;
+    header->length = state - start + 1;
+    header->sequence = sequence;
+
+    return source->write(source, state, 1, buffer) == 1;
+}
+
+/**
+ * Find the slot holding a sector
+ */
+static inline int32_t lookup(struct BlockLogDevice *log, uint32_t index) {
+    int32_t slot = log->table[index % log->count];
+
+    while (slot != SLOT_NONE) {
+        if (log->slots[slot].index == index)
+            return slot;
+
+        slot = log->slots[slot].chain;
+    }
+
+    return SLOT_NONE;
+}
+
+/**
+ * Writes the changes since the last commit to the log, as many groups as
+ * needed. Returns 0 when they don't fit in the log anymore.
+ */
+static int commit(struct BlockLogDevice *log) {
+    uint32_t blockSize = log->device.blockSize;
+    struct BlockLogGroup *group = (void*)log->group;
+    uint32_t slot = 0;
+
+    while (log->pending) {
+        memory_set(group, 0, blockSize);
+
+        for (; slot < log->used && group->count < log->groupSize; slot++) {
+            if (!log->slots[slot].pending)
+                continue;
+
+            memory_copy(log->group + (group->count + 1) * blockSize, slot_data(log, slot), blockSize);
+            group->targets[group->count++] = log->slots[slot].index;
+        }
+
+        uint32_t sectors = group->count + 1;
+        if (log->position + sectors > log->state)
+            return 0;
+
+        group->magic = LOG_GROUP_MAGIC;
+        group->sequence = log->sequence + 1;
+        group->checksum = checksum(2166136261u, log->group, sectors * blockSize);
+
+        // The whole group in one go, so a torn one fails the checksum
+        if (log->source->write(log->source, log->position, sectors, log->group) != sectors)
+            return 0;
+
+        if (!log->source->action(log->source, BLOCK_DEVICE_FLUSH))
+            return 0;
+
+        for (uint32_t index = 0; index < group->count; index++)
+            log->slots[lookup(log, group->targets[index])].pending = 0;
+
+        log->pending-= group->count;
+        log->position+= sectors;
+        log->sequence++;
+    }
+
+    return 1;
+}
+
+/**
+ * Writes every changed sector to its place, sorted so sectors that follow
+ * each other go in one write, after which the log starts over
+ */
+static int checkpoint(struct BlockLogDevice *log) {
+    uint32_t blockSize = log->device.blockSize;
+
+    if (log->used == 0)
+        return 1;
+
+    // What doesn't fit in the log anymore can only be written in place
+    commit(log);
+
+    for (uint32_t index = 0; index < log->used; index++)
+        log->order[index] = index;
+
+    // Insertion sort, there are only a few hundred at most
+    for (uint32_t index = 1; index < log->used; index++) {
+        uint32_t slot = log->order[index];
+        uint32_t position = index;
+
+        while (position > 0 && log->slots[log->order[position - 1]].index > log->slots[slot].index) {
+            log->order[position] = log->order[position - 1];
+            position--;
+        }
+
+        log->order[position] = slot;
+    }
+
+    for (uint32_t index = 0; index < log->used;) {
+        uint32_t first = log->slots[log->order[index]].index;
+        uint32_t count = 0;
+
+        while (index + count < log->used && count <= log->groupSize && log->slots[log->order[index + count]].index == first + count) {
+            memory_copy(log->group + count * blockSize, slot_data(log, log->order[index + count]), blockSize);
+            count++;
+        }
+
+        if (log->source->write(log->source, first, count, log->group) != count)
+            return 0;
+
+        index+= count;
+    }
+
+    // Everything must be in place before the log says so
+    if (!log->source->action(log->source, BLOCK_DEVICE_FLUSH))
+        return 0;
+
+    if (!write_state(log->source, log->state, log->start, log->sequence, log->group))
+        return 0;
+
+    for (uint32_t index = 0; index < log->count; index++)
+        log->table[index] = SLOT_NONE;
+
+    log->used = 0;
+    log->pending = 0;
+    log->position = log->start;
+
+    return log->source->action(log->source, BLOCK_DEVICE_FLUSH);
+}
+
+/**
+ * The metadata is consistent, commit once a group is full and checkpoint when
+ * memory or the log runs low
+ */
+static int block_log_action(const struct BlockDevice *device, bdaction_t action) {
+    struct BlockLogDevice *log = (void*)device;
+
+    switch (action) {
+        case BLOCK_DEVICE_FLUSH:
+            if (log->pending >= log->groupSize && !commit(log))
+                return checkpoint(log);
+
+            if (log->used >= log->count - log->count / 4 || log->position + log->groupSize + 1 > log->state)
+                return checkpoint(log);
+
+            return 1;
+        case BLOCK_DEVICE_CLOSE:
+            if (!checkpoint(log))
+                return 0;
+        break;
+        default:
+        break;
+    }
+
+    return log->source->action(log->source, action);
+}
+
+/**
+ * Read the given sectors, the changed ones from memory
+ */
+static uint32_t block_log_read(const struct BlockDevice *device, uint32_t index, uint32_t count, void *address) {
+    struct BlockLogDevice *log = (void*)device;
+    uint32_t blockSize = device->blockSize;
+    uint32_t offset = 0;
+
+    while (offset < count) {
+        uint32_t sector = index + offset;
+        int32_t slot = lookup(log, sector);
+
+        if (slot != SLOT_NONE) {
+            memory_copy(address + offset * blockSize, slot_data(log, slot), blockSize);
+            offset++;
+            continue;
+        }
+
+        // The log itself looks empty
+        if (sector >= log->start && sector <= log->state) {
+            memory_set(address + offset * blockSize, 0, blockSize);
+            offset++;
+            continue;
+        }
+
+        // Gather all following sectors that come from the source
+        uint32_t run = 1;
+        while (offset + run < count && lookup(log, sector + run) == SLOT_NONE && (sector + run < log->start || sector + run > log->state))
+            run++;
+
+        uint32_t read = log->source->read(log->source, sector, run, address + offset * blockSize);
+        if (read != run)
+            return offset + read;
+
+        offset+= run;
+    }
+
+    return count;
+}
+
+/**
+ * Write the given sectors, metadata is kept in memory and the rest goes
+ * straight to the source
+ */
+static uint32_t block_log_write(const struct BlockDevice *device, uint32_t index, uint32_t count, const void *address) {
+    struct BlockLogDevice *log = (void*)device;
+    uint32_t blockSize = device->blockSize;
+
+    if (index <= log->state && index + count > log->start)
+        return 0;
+
+    int metadata = index < log->boundary || count == 1;
+
+    if (!metadata) {
+        uint32_t written = log->source->write(log->source, index, count, address);
+
+        // Keep what's in memory the latest version
+        for (uint32_t offset = 0; offset < written; offset++) {
+            int32_t slot = lookup(log, index + offset);
+            if (slot == SLOT_NONE)
+                continue;
+
+            memory_copy(slot_data(log, slot), address + offset * blockSize, blockSize);
+            if (!log->slots[slot].pending) {
+                log->slots[slot].pending = 1;
+                log->pending++;
+            }
+        }
+
+        return written;
+    }
+
+    for (uint32_t offset = 0; offset < count; offset++) {
+        int32_t slot = lookup(log, index + offset);
+
+        if (slot == SLOT_NONE) {
+            // Out of memory in the middle of a change, which makes it not atomic
+            if (log->used == log->count && !checkpoint(log))
+                return offset;
+
+            slot = log->used++;
+            log->slots[slot].index = index + offset;
+            log->slots[slot].pending = 0;
+            log->slots[slot].chain = log->table[(index + offset) % log->count];
+            log->table[(index + offset) % log->count] = slot;
+        }
+
+        memory_copy(slot_data(log, slot), address + offset * blockSize, blockSize);
+        if (!log->slots[slot].pending) {
+            log->slots[slot].pending = 1;
+            log->pending++;
+        }
+    }
+
+    return count;
+}
+
+size_t block_log_device_size(const struct BlockDevice *source, uint32_t count) {
+    uint32_t groupSize = count < max_targets(source) ? count : max_targets(source);
+
+    // Room to align the data to what the source requires
+    return sizeof(struct BlockLogDevice) + count * slot_size(source) + (groupSize + 1) * source->blockSize + source->alignment;
+}
+
+int block_log_format(const struct BlockDevice *source, uint32_t start, uint32_t length, void *buffer) {
+    if (length < 3)
+        return 0;
+
+    return write_state(source, start + length - 1, start, 0, buffer);
+}
+
+int block_log_replay(const struct BlockDevice *source, uint32_t state, void *buffer) {
+    uint32_t blockSize = source->blockSize;
+    struct BlockLogGroup *group = buffer;
+    void *sector = buffer + blockSize;
+
+    if (source->read(source, state, 1, buffer) != 1)
+        return -1;
+
+    struct BlockLogState *header = buffer;
+    if (header->magic != LOG_STATE_MAGIC || header->length < 3 || header->start + header->length - 1 != state)
+        return 0;
+
+    uint32_t start = header->start;
+    uint32_t sequence = header->sequence;
+    uint32_t position = start;
+    int replayed = 0;
+
+    while (position < state) {
+        if (source->read(source, position, 1, group) != 1)
+            return -1;
+
+        if (group->magic != LOG_GROUP_MAGIC || group->sequence != sequence + 1)
+            break;
+
+        if (group->count == 0 || group->count > max_targets(source) || position + group->count + 1 > state)
+            break;
+
+        // Check the whole group before any of it is put in place
+        uint32_t expected = group->checksum;
+        group->checksum = 0;
+        uint32_t hash = checksum(2166136261u, group, blockSize);
+        group->checksum = expected;
+
+        for (uint32_t index = 0; index < group->count; index++) {
+            if (source->read(source, position + 1 + index, 1, sector) != 1)
+                return -1;
+
+            hash = checksum(hash, sector, blockSize);
+        }
+
+        if (hash != expected)
+            break;
+
+        for (uint32_t index = 0; index < group->count; index++) {
+            if (source->read(source, position + 1 + index, 1, sector) != 1)
+                return -1;
+
+            if (source->write(source, group->targets[index], 1, sector) != 1)
+                return -1;
+        }
+
+        position+= group->count + 1;
+        sequence++;
+        replayed++;
+    }
+
+    if (replayed) {
+        if (!source->action(source, BLOCK_DEVICE_FLUSH))
+            return -1;
+
+        if (!write_state(source, state, start, sequence, buffer))
+            return -1;
+
+        if (!source->action(source, BLOCK_DEVICE_FLUSH))
+            return -1;
+    }
+
+    return replayed;
+}
+
+int block_log_get_device(struct BlockDevice *device, size_t size, const struct BlockDevice *source, uint32_t state, uint32_t boundary) {
+    size_t fixed = sizeof(struct BlockLogDevice) + source->alignment + source->blockSize;
+    if (size < fixed)
+        return 0;
+
+    // Every slot may need a sector in a group, unless the groups are full
+    uint32_t count = (size - fixed) / (slot_size(source) + source->blockSize);
+    if (count > max_targets(source))
+        count = (size - fixed - max_targets(source) * source->blockSize) / slot_size(source);
+
+    if (count < 2)
+        return 0;
+
+    struct BlockLogDevice *log = (void*)device;
+    log->device.size      = sizeof(struct BlockLogDevice);
+    log->device.blockSize = source->blockSize;
+    log->device.alignment = source->alignment;
+    log->device.action    = block_log_action;
+    log->device.read      = block_log_read;
+    log->device.write     = block_log_write;
+    log->device.readv     = 0;
+    log->device.writev    = 0;
+    log->device.submit    = 0;
+    log->source           = source;
+    log->count            = count;
+    log->used             = 0;
+    log->pending          = 0;
+    log->groupSize        = count < max_targets(source) ? count : max_targets(source);
+    log->boundary         = boundary;
+    log->slots            = ((void*)device) + sizeof(struct BlockLogDevice);
+    log->table            = (void*)(log->slots + count);
+    log->order            = (void*)(log->table + count);
+    log->data             = (void*)(log->order + count);
+
+    if (source->alignment > 1) {
+        size_t misaligned = (size_t)log->data % source->alignment;
+        if (misaligned)
+            log->data+= source->alignment - misaligned;
+    }
+
+    log->group = log->data + count * source->blockSize;
+
+    // Whatever a crash left behind goes in place first
+    if (block_log_replay(source, state, log->group) < 0)
+        return 0;
+
+    if (source->read(source, state, 1, log->group) != 1)
+        return 0;
+
+    struct BlockLogState *header = (void*)log->group;
+    if (header->magic != LOG_STATE_MAGIC || header->length < 3 || header->start + header->length - 1 != state)
+        return 0;
+
+    // A few groups must fit in the log before it has to be checkpointed
+    if (log->groupSize > (header->length - 1) / 4)
+        log->groupSize = (header->length - 1) / 4 ? (header->length - 1) / 4 : 1;
+
+    log->start    = header->start;
+    log->state    = state;
+    log->position = header->start;
+    log->sequence = header->sequence;
+
+    for (uint32_t index = 0; index < count; index++)
+        log->table[index] = SLOT_NONE;
+
+    return 1;
+}
+
+const struct BlockDevice *block_log_get_source(const struct BlockDevice *device) {
+    return ((struct BlockLogDevice*)device)->source;
+}
@@ -0,0 +1,301 @@
+#include <io/queue.h>
+#include <memory.h>
+
+// Number of merged transfers that can be on their way at once
+#define QUEUE_TRANSFERS 8
+
+/**
+ * A single transfer to the device, made of one or more requests
+ */
+struct BlockTransfer {
+    struct BlockRequest request;
+    struct BlockRequest *members;
+    struct BlockQueue *queue;
+    uint32_t busy;
+};
+
+struct BlockQueue {
+    const struct BlockDevice *device;
+    struct BlockRequest *head;
+    struct BlockRequest *tail;
+    uint32_t count;
+    uint32_t used;
+    uint32_t inFlight;
+    struct BlockTransfer transfers[QUEUE_TRANSFERS];
+    uint8_t *buffer;
+};
+
+static inline int is_aligned(const struct BlockDevice *device, const void *address) {
+    if (device->alignment <= 1)
+        return 1;
+
+    return ((size_t)address % device->alignment) == 0;
+}
+
+/**
+ * Two requests can't change order when they touch the same sectors and one
+ * of them writes
+ */
+static inline int conflicts(const struct BlockRequest *first, const struct BlockRequest *second) {
+    if (!first->write && !second->write)
+        return 0;
+
+    return first->index < second->index + second->count && second->index < first->index + first->count;
+}
+
+/**
+ * Whether the request would pass one that was queued before it, or one that
+ * is still on its way to the device
+ */
+static int is_blocked(struct BlockQueue *queue, const struct BlockRequest *request) {
+    for (struct BlockRequest *cursor = queue->head; cursor && cursor != request; cursor = cursor->next) {
+        if (conflicts(cursor, request))
+            return 1;
+    }
+
+    for (uint32_t index = 0; index < QUEUE_TRANSFERS && queue->inFlight; index++) {
+        if (queue->transfers[index].busy && conflicts(&queue->transfers[index].request, request))
+            return 1;
+    }
+
+    return 0;
+}
+
+static void dequeue(struct BlockQueue *queue, struct BlockRequest *previous, struct BlockRequest *request) {
+    if (previous) {
+        previous->next = request->next;
+    } else {
+        queue->head = request->next;
+    }
+
+    if (queue->tail == request)
+        queue->tail = previous;
+
+    request->next = 0;
+}
+
+/**
+ * Hands every request of the transfer its part, copying it out of the buffer
+ * when the transfer went through it
+ */
+static void transfer_complete(struct BlockRequest *request) {
+    struct BlockTransfer *transfer = request->data;
+    struct BlockQueue *queue = transfer->queue;
+    uint32_t blockSize = queue->device->blockSize;
+    struct BlockRequest *member = transfer->members;
+
+    while (member) {
+        // The callback may reuse the request
+        struct BlockRequest *next = member->next;
+        uint32_t offset = member->index - request->index;
+
+        if (request->done >= offset + member->count) {
+            member->done = member->count;
+        } else {
+            member->done = request->done > offset ? request->done - offset : 0;
+        }
+
+        if (!request->write && request->address != member->address)
+            memory_copy(member->address, request->address + offset * blockSize, member->done * blockSize);
+
+        member->next = 0;
+        if (member->complete)
+            member->complete(member);
+
+        member = next;
+    }
+
+    transfer->busy = 0;
+
+    // The buffer is only reused once nothing points into it anymore
+    if (--queue->inFlight == 0)
+        queue->used = 0;
+}
+
+/**
+ * Takes the first request and the ones that can go with it out of the queue
+ */
+static int gather(struct BlockQueue *queue, struct BlockTransfer *transfer) {
+    struct BlockRequest *first = queue->head;
+    struct BlockRequest *last = first;
+    uint32_t start = first->index;
+    uint32_t end = first->index + first->count;
+    uint32_t room = queue->count - queue->used;
+    int merged;
+
+    dequeue(queue, 0, first);
+
+    // Keep going while one request makes room for the next to merge
+    do {
+        struct BlockRequest *previous = 0;
+        struct BlockRequest *cursor = queue->head;
+
+        merged = 0;
+        while (cursor) {
+            struct BlockRequest *next = cursor->next;
+            uint32_t low = cursor->index < start ? cursor->index : start;
+            uint32_t high = cursor->index + cursor->count > end ? cursor->index + cursor->count : end;
+
+            if (cursor->write == first->write && cursor->index <= end && cursor->index + cursor->count >= start && high - low <= room && !is_blocked(queue, cursor)) {
+                dequeue(queue, previous, cursor);
+                last->next = cursor;
+                last = cursor;
+                start = low;
+                end = high;
+                merged = 1;
+            } else {
+                previous = cursor;
+            }
+
+            cursor = next;
+        }
+    } while (merged);
+
+    transfer->members = first;
+    transfer->request.index = start;
+    transfer->request.count = end - start;
+    transfer->request.write = first->write;
+    transfer->request.done = 0;
+
+    // On its own it can go straight from the memory of the request
+    if (first->next == 0 && is_aligned(queue->device, first->address)) {
+        transfer->request.address = first->address;
+        return 1;
+    }
+
+    if (end - start > room) {
+        // Waits for the transfers that use the buffer, unless there are none
+        if (queue->used) {
+            first->next = queue->head;
+            queue->head = first;
+            if (queue->tail == 0)
+                queue->tail = first;
+
+            return 0;
+        }
+
+        transfer->request.address = first->address;
+        return 1;
+    }
+
+    uint32_t blockSize = queue->device->blockSize;
+    transfer->request.address = queue->buffer + queue->used * blockSize;
+    queue->used+= end - start;
+
+    // In the order they were queued, so the last write to a sector wins
+    if (first->write) {
+        for (struct BlockRequest *member = first; member; member = member->next)
+            memory_copy(transfer->request.address + (member->index - start) * blockSize, member->address, member->count * blockSize);
+    }
+
+    return 1;
+}
+
+size_t block_queue_size(const struct BlockDevice *device, uint32_t count) {
+    // Room to align the buffer to what the device requires
+    return sizeof(struct BlockQueue) + count * device->blockSize + device->alignment;
+}
+
+int block_queue_init(struct BlockQueue *queue, size_t size, const struct BlockDevice *device) {
+    if (size < sizeof(struct BlockQueue) + device->alignment)
+        return 0;
+
+    queue->device   = device;
+    queue->head     = 0;
+    queue->tail     = 0;
+    queue->count    = (size - sizeof(struct BlockQueue) - device->alignment) / device->blockSize;
+    queue->used     = 0;
+    queue->inFlight = 0;
+    queue->buffer   = ((void*)queue) + sizeof(struct BlockQueue);
+
+    if (device->alignment > 1) {
+        size_t misaligned = (size_t)queue->buffer % device->alignment;
+        if (misaligned)
+            queue->buffer+= device->alignment - misaligned;
+    }
+
+    for (uint32_t index = 0; index < QUEUE_TRANSFERS; index++) {
+        queue->transfers[index].queue = queue;
+        queue->transfers[index].busy = 0;
+        queue->transfers[index].request.complete = transfer_complete;
+        queue->transfers[index].request.data = queue->transfers + index;
+    }
+
+    return 1;
+}
+
+int block_queue_submit(struct BlockQueue *queue, struct BlockRequest *request) {
+    if (request->count == 0)
+        return 0;
+
+    request->done = 0;
+    request->next = 0;
+
+    if (queue->tail) {
+        queue->tail->next = request;
+    } else {
+        queue->head = request;
+    }
+
+    queue->tail = request;
+    return 1;
+}
+
+uint32_t block_queue_dispatch(struct BlockQueue *queue) {
+    const struct BlockDevice *device = queue->device;
+    uint32_t started = 0;
+
+    while (queue->head) {
+        struct BlockTransfer *transfer = 0;
+        for (uint32_t index = 0; index < QUEUE_TRANSFERS && transfer == 0; index++) {
+            if (!queue->transfers[index].busy)
+                transfer = queue->transfers + index;
+        }
+
+        // The first one waits for the transfers it conflicts with
+        if (transfer == 0 || is_blocked(queue, queue->head) || !gather(queue, transfer))
+            break;
+
+        transfer->busy = 1;
+        queue->inFlight++;
+        started++;
+
+        struct BlockRequest *request = &transfer->request;
+
+        if (device->submit) {
+            if (!device->submit(device, request))
+                transfer_complete(request);
+
+            continue;
+        }
+
+        // Without submit it's done before moving on
+        if (request->write) {
+            request->done = device->write(device, request->index, request->count, request->address);
+        } else {
+            request->done = device->read(device, request->index, request->count, request->address);
+        }
+
+        transfer_complete(request);
+    }
+
+    return started;
+}
+
+int block_queue_finish(struct BlockQueue *queue) {
+    block_queue_dispatch(queue);
+
+    // Every completion frees a transfer or room in the buffer for the rest
+    while (queue->inFlight) {
+        if (!queue->device->action(queue->device, BLOCK_DEVICE_WAIT))
+            return 0;
+
+        block_queue_dispatch(queue);
+    }
+
+    return 1;
+}
+
+uint32_t block_queue_in_flight(const struct BlockQueue *queue) {
+    return queue->inFlight;
+}
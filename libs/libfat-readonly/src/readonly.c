@@ -1,6 +1,22 @@
 #include <fs/fat/readonly.h>
 #include <memory.h>
 
+// Number of extents read with a single vectored read
+#define FAT_READ_SEGMENTS 8
+
+/**
+ * Takes a piece of the buffer for permanent use
+ */
+static void *reserve(struct FATContext *ctx, size_t size) {
+    // Keep what is handed out 4 byte aligned
+    size_t padding = (4 - ((size_t)ctx->buffer & 3)) & 3;
+    void *ptr = ctx->buffer + padding;
+
+    ctx->buffer+= padding + size;
+    ctx->bufferSize-= padding + size;
+    return ptr;
+}
+
 int fat_init_context(struct FATContext *ctx, size_t size, const struct BlockDevice *device) {
     // Minumum size required to function
     if(size < sizeof(struct FATContext) + device->blockSize * 2)
@@ -22,7 +38,19 @@ int fat_init_context(struct FATContext *ctx, size_t size, const struct BlockDevi
     ctx->device = device;
     ctx->header = &bpb->header;
     ctx->buffer = ((void*)ctx) + sizeof(struct FATContext)  + sizeof(struct FATBPB);
-    ctx->bufferSize = size - sizeof(struct FATContext)  + sizeof(struct FATBPB);
+    ctx->bufferSize = size - sizeof(struct FATContext)  - sizeof(struct FATBPB);
+    ctx->fat = 0;
+    ctx->expanded = 0;
+    ctx->pages = 0;
+    ctx->numberOfPages = 0;
+    ctx->pageClock = 0;
+    ctx->index = 0;
+    ctx->paths = 0;
+    ctx->freeMap = 0;
+    ctx->dirty = 0;
+    ctx->clock = 0;
+    ctx->freeClusters = FAT_FSINFO_UNKNOWN;
+    ctx->nextFree = FAT_FSINFO_UNKNOWN;
 
     // They found out 16 bit we'ern't enough so added a new 32 bit one, yeah!
     uint32_t totalNumberOfSectors = bpb->header.smallNumberOfSectors
@@ -57,9 +85,32 @@ int fat_init_context(struct FATContext *ctx, size_t size, const struct BlockDevi
         // Now we can calculate the sector size of the data area and divide it by the sectors per
         // cluster, to get the number of clusters
         ctx->numberOfClusters = (totalNumberOfSectors - ctx->startOfData) / bpb->header.sectorsPerCluster;
+        ctx->sectorsPerFat = bpb->fat32.extended.sectorsPerFat;
+
+        // The root directory is a normal cluster chain now
+        if (bpb->fat32.extended.rootCluster < 2 || bpb->fat32.extended.rootCluster >= ctx->numberOfClusters + 2)
+            return FAT_ERR_INVALID_FAT32;
+
+        // The FSInfo sector has hints about the free space, which can be
+        // missing or stale so they are only used when it looks valid
+        uint16_t infoSector = bpb->fat32.extended.fileSystemInfoSector;
+        if (infoSector != 0 && infoSector != 0xFFFF && infoSector < bpb->header.reservedSectors) {
+            if (device->read(device, infoSector, 1, ctx->buffer) != 1)
+                return FAT_ERR_FAILED_READ;
+
+            struct FATFileSystemInfo *info = ctx->buffer;
+            if (info->leadSignature == FAT_FSINFO_LEAD_SIGNATURE && info->structureSignature == FAT_FSINFO_STRUCTURE_SIGNATURE) {
+                if (info->freeClusters <= ctx->numberOfClusters)
+                    ctx->freeClusters = info->freeClusters;
+
+                if (info->nextFree >= 2 && info->nextFree < ctx->numberOfClusters + 2)
+                    ctx->nextFree = info->nextFree;
+            }
+        }
     } else {
         ctx->extended = 0;
         ctx->bootSector = &bpb->fat1x.bootSector;
+        ctx->sectorsPerFat = bpb->header.sectorsPerFat;
 
         if (bpb->fat1x.bootSector.extendedBootSignature == 0x29) {
             ctx->signature = &bpb->fat1x.signature;
@@ -98,17 +149,159 @@ int fat_init_context(struct FATContext *ctx, size_t size, const struct BlockDevi
     }
 
     // Only when the table size is less then  2/3 of buffer size load table
-    size_t tableSize = ctx->header->sectorsPerFat * ctx->header->bytesPerSector;
+    size_t tableSize = ctx->sectorsPerFat * ctx->header->bytesPerSector;
     if (tableSize < (ctx->bufferSize * 2 / 3)) {
-        uint32_t read = device->read(device, bpb->header.reservedSectors, ctx->header->sectorsPerFat, ctx->buffer);
+        // Aligned, as the FAT12 entries are packed and unpacked a word at a time
+        ctx->fat = reserve(ctx, tableSize);
+        uint32_t read = device->read(device, bpb->header.reservedSectors, ctx->sectorsPerFat, ctx->fat);
 
-        if (read != ctx->header->sectorsPerFat)
+        if (read != ctx->sectorsPerFat)
             return FAT_ERR_FAILED_READ_FAT;
 
-        ctx->fat = ctx->buffer;
-        ctx->buffer+= tableSize;
-        ctx->bufferSize-= tableSize;
+        // Changes are tracked per sector, so only those are written back
+        uint32_t words = (ctx->sectorsPerFat + 31) / 32;
+        ctx->dirty = reserve(ctx, words * sizeof(uint32_t));
+        memory_set(ctx->dirty, 0, words * sizeof(uint32_t));
+    } else {
+        // Otherwise only keep a few sectors of it, but leave room for a cluster
+        size_t clusterSize = ctx->header->sectorsPerCluster * ctx->header->bytesPerSector;
+        size_t pageSize = sizeof(struct FATTablePage) + ctx->header->bytesPerSector;
+
+        uint32_t count = FAT_TABLE_PAGES;
+        while (count > 0 && count * pageSize + clusterSize + sizeof(uint32_t) > ctx->bufferSize)
+            count--;
+
+        if (count == 0)
+            return FAT_ERR_MINIMUM_SIZE;
+
+        ctx->pages = reserve(ctx, count * sizeof(struct FATTablePage));
+        ctx->numberOfPages = count;
+
+        for (uint32_t index = 0; index < count; index++) {
+            ctx->pages[index].sector = FAT_PAGE_EMPTY;
+            ctx->pages[index].lastUsed = 0;
+            ctx->pages[index].dirty = 0;
+            ctx->pages[index].data = reserve(ctx, ctx->header->bytesPerSector);
+        }
+    }
+
+    return FAT_SUCCESS;
+}
+
+/**
+ * Get a sector of the FAT. When the table isn't in memory it's loaded into the
+ * least recently used page.
+ */
+void *fat_table_sector(struct FATContext *ctx, uint32_t sector) {
+    if (ctx->fat)
+        return ctx->fat + sector * ctx->header->bytesPerSector;
+
+    register struct FATTablePage *page = ctx->pages;
+    struct FATTablePage *victim = page;
+
+    for (uint32_t index = 0; index < ctx->numberOfPages; index++, page++) {
+        if (page->sector == sector) {
+            page->lastUsed = ++ctx->pageClock;
+            return page->data;
+        }
+
+        if (page->lastUsed < victim->lastUsed)
+            victim = page;
+    }
+
+    // A page changed by the write library goes to every copy before it's reused
+    if (victim->dirty) {
+        for (uint32_t copy = 0; copy < ctx->header->numberOfFatCopies; copy++) {
+            uint32_t sectorIndex = ctx->header->reservedSectors + copy * ctx->sectorsPerFat + victim->sector;
+
+            if (ctx->device->write(ctx->device, sectorIndex, 1, victim->data) != 1)
+                return 0;
+        }
+
+        victim->dirty = 0;
+    }
+
+    if (ctx->device->read(ctx->device, ctx->header->reservedSectors + sector, 1, victim->data) != 1) {
+        victim->sector = FAT_PAGE_EMPTY;
+        victim->lastUsed = 0;
+        return 0;
+    }
+
+    victim->sector = sector;
+    victim->lastUsed = ++ctx->pageClock;
+    return victim->data;
+}
+
+/**
+ * Reads a value of 2 or 4 bytes from the FAT through the pages. Only a FAT12
+ * entry can straddle two sectors, then each byte comes from a different page.
+ */
+static uint32_t table_read(struct FATContext *ctx, uint32_t offset, uint32_t size) {
+    uint32_t bytesPerSector = ctx->header->bytesPerSector;
+    uint32_t sector = offset / bytesPerSector;
+    offset%= bytesPerSector;
+
+    uint8_t *data = fat_table_sector(ctx, sector);
+    if (data == 0)
+        return 0xFFFFFFFF;
+
+    if (offset + size <= bytesPerSector) {
+        if (size == 4)
+            return *(uint32_t*)(data + offset);
+        return *(uint16_t*)(data + offset);
+    }
+
+    uint32_t value = data[offset];
+
+    if ((data = fat_table_sector(ctx, sector + 1)) == 0)
+        return 0xFFFFFFFF;
+
+    return value | (data[0] << 8);
+}
+
+/**
+ * Unpacks 12 bit entries, 8 at a time from 3 words
+ */
+static void unpack_fat12(const uint8_t *source, uint16_t *destination, uint32_t count) {
+    uint32_t index = 0;
+
+    for (; index + 8 <= count; index+= 8, source+= 12) {
+        register uint32_t w0 = ((const uint32_t*)source)[0];
+        register uint32_t w1 = ((const uint32_t*)source)[1];
+        register uint32_t w2 = ((const uint32_t*)source)[2];
+        uint32_t *pairs = (uint32_t*)(destination + index);
+
+        pairs[0] = (w0 & 0xFFF) | ((w0 & 0xFFF000) << 4);
+        pairs[1] = (w0 >> 24) | ((w1 & 0xF) << 8) | ((w1 & 0xFFF0) << 12);
+        pairs[2] = ((w1 >> 16) & 0xFFF) | ((w1 >> 28) << 16) | ((w2 & 0xFF) << 20);
+        pairs[3] = ((w2 >> 8) & 0xFFF) | ((w2 >> 20) << 16);
+    }
+
+    // The remaining ones the slow way
+    for (; index < count; index++) {
+        uint32_t offset = (index & 7) + (index & 7) / 2;
+        uint16_t value = source[offset] | (source[offset + 1] << 8);
+
+        destination[index] = (index & 1) ? value >> 4 : value & 0xFFF;
     }
+}
+
+int fat_expand_table(struct FATContext *ctx) {
+    if (ctx->type != FAT12 || ctx->fat == 0)
+        return FAT_ERROR;
+
+    if (ctx->expanded)
+        return FAT_SUCCESS;
+
+    // Every cluster has an entry, plus the first 2 that are reserved
+    uint32_t count = ctx->numberOfClusters + 2;
+    size_t clusterSize = ctx->header->sectorsPerCluster * ctx->header->bytesPerSector;
+
+    if (count * sizeof(uint16_t) + clusterSize + sizeof(uint32_t) > ctx->bufferSize)
+        return FAT_ERR_MINIMUM_SIZE;
+
+    ctx->expanded = reserve(ctx, count * sizeof(uint16_t));
+    unpack_fat12(ctx->fat, ctx->expanded, count);
 
     return FAT_SUCCESS;
 }
@@ -117,6 +310,32 @@ int fat_init_context(struct FATContext *ctx, size_t size, const struct BlockDevi
  * Reads the value in the fat at index
  */ 
 uint32_t fat_next_cluster(struct FATContext *ctx, uint32_t index) {
+    uint32_t value;
+
+    if (ctx->expanded)
+        return ctx->expanded[index];
+
+    if (ctx->fat == 0) {
+        switch (ctx->type) {
+            case FAT12:
+                value = table_read(ctx, index + index / 2, 2);
+                if (value == 0xFFFFFFFF)
+                    return value;
+                if(index & 1)
+                    return value >> 4;
+                return value & 0xFFF;
+            case FAT16:
+                return table_read(ctx, index * 2, 2);
+            case FAT32:
+                value = table_read(ctx, index * 4, 4);
+                if (value == 0xFFFFFFFF)
+                    return value;
+                return value & FAT32_MASK;
+        }
+
+        return 0;
+    }
+
     switch (ctx->type) {
         case FAT12:
             uint16_t *ptr = ctx->fat + (index + index / 2);
@@ -126,7 +345,8 @@ uint32_t fat_next_cluster(struct FATContext *ctx, uint32_t index) {
         case FAT16:
             return ((uint16_t*)ctx->fat)[index];
         case FAT32:
-            return ((uint32_t*)ctx->fat)[index];
+            // The top 4 bits are reserved
+            return ((uint32_t*)ctx->fat)[index] & FAT32_MASK;
     }
 
     return 0;
@@ -136,8 +356,8 @@ uint32_t fat_next_cluster(struct FATContext *ctx, uint32_t index) {
  * To test if an index value is a EOC mark
  */
 static inline int is_eoc(struct FATContext *ctx, uint32_t index) {
-    // The first 2 don't exist
-    if (index < 2 || index >= ctx->numberOfClusters)
+    // The first 2 don't exist, so the last one is at numberOfClusters + 1
+    if (index < 2 || index >= ctx->numberOfClusters + 2)
         return 1;
 
     switch (ctx->type) {
@@ -157,39 +377,182 @@ int fat_is_eoc(struct FATContext *ctx, uint32_t index){
     return is_eoc(ctx, index);
 }
 
+/**
+ * To test if the device can transfer directly from or to an address
+ */
+static inline int is_aligned(const struct BlockDevice *device, const void *address) {
+    if (device->alignment <= 1)
+        return 1;
+
+    return ((size_t)address % device->alignment) == 0;
+}
+
 /**
  * Reads the contents of the cluster into the buffer
  */
 size_t fat_read_cluster(struct FATContext *ctx, uint32_t index, void *dst, size_t size) {
     uint32_t sectorCount = ctx->header->sectorsPerCluster;
     uint32_t sectorIndex = ctx->startOfData + ((index - 2) * sectorCount);
+    size_t clusterSize = sectorCount * ctx->header->bytesPerSector;
+
+    // When the whole cluster fits and the device can handle the address, skip
+    // the buffer and the extra copy
+    if (size >= clusterSize && is_aligned(ctx->device, dst)) {
+        if (ctx->device->read(ctx->device, sectorIndex, sectorCount, dst) != sectorCount)
+            return 0;
+
+        return clusterSize;
+    }
 
     uint32_t read = ctx->device->read(ctx->device, sectorIndex, sectorCount, ctx->buffer);
-    
+
     if (read != sectorCount)
         return 0;
 
-    if(size > sectorCount * ctx->header->bytesPerSector)
-        size = sectorCount * ctx->header->bytesPerSector;
+    if(size > clusterSize)
+        size = clusterSize;
 
     memory_copy(dst, ctx->buffer, size);
     return size;
 }
 
 /**
-  * Structure to keep track where we are at reading
-  */
-struct FATDirectoryReader {
-    uint32_t clusterIndex;
-    uint32_t sectorCount;
-    uint32_t sectorIndex;
-    uint32_t entriesCount;
-};
+ * Walks the chain and merges clusters that follow each other into extents
+ */
+int32_t fat_get_extents(struct FATContext *ctx, uint32_t *cluster, struct FATExtent *extents, int32_t size) {
+    register uint32_t index = *cluster;
+    int32_t count = 0;
+
+    while (count < size && !is_eoc(ctx, index)) {
+        extents[count].cluster = index;
+        extents[count].length = 1;
+
+        // Keep growing the extent as long as the next cluster is the one directly after it
+        uint32_t next;
+        while ((next = fat_next_cluster(ctx, index)) == index + 1 && !is_eoc(ctx, next)) {
+            extents[count].length++;
+            index = next;
+        }
+
+        index = next;
+        count++;
+    }
+
+    *cluster = index;
+    return count;
+}
+
+/**
+ * Reads the whole clusters of an extent directly into the buffer
+ */
+size_t fat_read_extent(struct FATContext *ctx, const struct FATExtent *extent, void *dst, size_t size) {
+    uint32_t sectorsPerCluster = ctx->header->sectorsPerCluster;
+    size_t clusterSize = sectorsPerCluster * ctx->header->bytesPerSector;
+
+    uint32_t clusters = size / clusterSize;
+    if (clusters > extent->length)
+        clusters = extent->length;
+
+    size_t read = 0;
+
+    // The device can't transfer to this address, so it has to go cluster by
+    // cluster through the buffer
+    if (!is_aligned(ctx->device, dst)) {
+        for (uint32_t index = 0; index < extent->length && read < size; index++) {
+            size_t bytes = fat_read_cluster(ctx, extent->cluster + index, dst + read, size - read);
+            if (bytes == 0)
+                break;
+
+            read+= bytes;
+        }
+
+        return read;
+    }
+
+    if (clusters > 0) {
+        uint32_t sectorIndex = ctx->startOfData + ((extent->cluster - 2) * sectorsPerCluster);
+        uint32_t sectorCount = clusters * sectorsPerCluster;
+
+        if (ctx->device->read(ctx->device, sectorIndex, sectorCount, dst) != sectorCount)
+            return 0;
+
+        read = clusters * clusterSize;
+    }
+
+    // Only the last cluster can be partial, and that one goes through the buffer
+    if (clusters < extent->length && read < size)
+        read+= fat_read_cluster(ctx, extent->cluster + clusters, dst + read, size - read);
+
+    return read;
+}
+
+size_t fat_read_extents(struct FATContext *ctx, const struct FATExtent *extents, int32_t count, void *dst, size_t size) {
+    uint32_t sectorsPerCluster = ctx->header->sectorsPerCluster;
+    size_t clusterSize = sectorsPerCluster * ctx->header->bytesPerSector;
+    size_t read = 0;
+
+    // Unaligned memory goes through the buffer anyway
+    if (!is_aligned(ctx->device, dst)) {
+        for (int32_t index = 0; index < count && read < size; index++) {
+            size_t bytes = fat_read_extent(ctx, extents + index, dst + read, size - read);
+            if (bytes == 0)
+                break;
+
+            read+= bytes;
+        }
+
+        return read;
+    }
+
+    int32_t index = 0;
+    while (index < count && size - read >= clusterSize) {
+        struct BlockSegment segments[FAT_READ_SEGMENTS];
+        uint32_t numberOfSegments = 0;
+        uint32_t sectors = 0;
+
+        // The whole clusters of as many extents as fit in one read
+        for (; index < count && numberOfSegments < FAT_READ_SEGMENTS; index++) {
+            uint32_t clusters = (size - read) / clusterSize - sectors / sectorsPerCluster;
+            if (clusters == 0)
+                break;
+
+            if (clusters > extents[index].length)
+                clusters = extents[index].length;
+
+            segments[numberOfSegments].index = ctx->startOfData + ((extents[index].cluster - 2) * sectorsPerCluster);
+            segments[numberOfSegments].count = clusters * sectorsPerCluster;
+            segments[numberOfSegments].address = dst + read + sectors * ctx->header->bytesPerSector;
+            numberOfSegments++;
+            sectors+= clusters * sectorsPerCluster;
+
+            if (clusters < extents[index].length)
+                break;
+        }
+
+        if (block_readv(ctx->device, segments, numberOfSegments) != sectors)
+            return read;
+
+        read+= sectors * ctx->header->bytesPerSector;
+    }
+
+    // Only the last cluster can be partial, and that one goes through the buffer
+    if (index < count && read < size) {
+        uint32_t offset = read / clusterSize;
+
+        // Find the cluster the read stopped at
+        for (int32_t previous = 0; previous < index; previous++)
+            offset-= extents[previous].length;
+
+        read+= fat_read_cluster(ctx, extents[index].cluster + offset, dst + read, size - read);
+    }
+
+    return read;
+}
 
 /**
- * Reads a single cluster or the whole root directory
+ * Points the reader at the sectors of its cluster or the whole root directory
  */
-static inline int fat_directory_reader_read(struct FATContext *ctx, struct FATDirectoryReader *reader) {
+static inline void fat_directory_reader_start(struct FATContext *ctx, struct FATDirectoryReader *reader) {
     if (reader->clusterIndex == 0) {
         reader->sectorCount = ctx->startOfData - ctx->startOfRootDirectory;
         reader->entriesCount = ctx->header->numberOfRootEntries;
@@ -200,6 +563,13 @@ static inline int fat_directory_reader_read(struct FATContext *ctx, struct FATDi
         reader->entriesCount = reader->sectorCount * ctx->header->bytesPerSector / 32;
         reader->sectorIndex = ctx->startOfData + ((reader->clusterIndex - 2) * reader->sectorCount);
     }
+}
+
+/**
+ * Reads a single cluster or the whole root directory
+ */
+static inline int fat_directory_reader_read(struct FATContext *ctx, struct FATDirectoryReader *reader) {
+    fat_directory_reader_start(ctx, reader);
 
     uint32_t read = ctx->device->read(ctx->device, reader->sectorIndex, reader->sectorCount, ctx->buffer);
 
@@ -219,121 +589,541 @@ static inline int fat_directory_reader_next(struct FATContext *ctx, struct FATDi
 }
 
 /**
- * When it find the file it will return it entry, when it has a long name and size would
- * fit the name, the entries will be filled with does entries, otherwise it will return
- * only the entry with the dos name. When file found is a directory it will load the
- * entries of the directory up to the size.
- * 
- *  @param ctx 		The context
- *  @param entries 	Pointer to single entry or array of entries
- *  @param size 	Size available in the entries
- *  @param path 	A null-delimited string with the short entry path to be found
- *  @return Number of entries found
+ * Turns the first segment of the path into the directory entry format for
+ * easy compare. Returns the path after the segment or 0 when it's not valid.
  */
-int32_t fat_find_file(struct FATContext *ctx, struct FATDirectoryEntry *entries, int32_t size, const char *path) {
-    uint8_t segment[11];
-    struct FATDirectoryReader reader;
-    reader.clusterIndex = ctx->extended ? ctx->extended->rootCluster : 0;
-    int hasPath;
-    int32_t count = 0;
-
-    next:
-    // Remove any traling slashes
-    while (*path == '/' || *path == '\\') 
-        path++;
+const char *fat_parse_segment(const char *path, uint8_t *segment) {
+    uint8_t *ptr = segment;
 
-    // If de path is not empty turn first segment into directory
-    // format for easy compare
-    hasPath = *path ? 1 : 0;
-    if (hasPath) {
-        uint8_t *ptr = segment;
+    if (*path == '.') {
+        *ptr++ = *path++;
+        int i = 1;
 
-        if (*path == '.') {
+        if(*path == '.'){
             *ptr++ = *path++;
-            int i = 1;
-
-            if(*path == '.'){
-                *ptr++ = *path++;
-                i++;
-            }
+            i++;
+        }
 
-            for (; i < 11; i++)
-                *ptr++ = 0x20;
-        } else {
-            for (int i = 0; i < 11; i++) {
-                switch (*path) {
-                    case '/':
-                    case '\\':
-                    case '\0':
+        for (; i < 11; i++)
+            *ptr++ = 0x20;
+    } else {
+        for (int i = 0; i < 11; i++) {
+            switch (*path) {
+                case '/':
+                case '\\':
+                case '\0':
+                    *ptr++ = 0x20;
+                break;
+                case '.':
+                    if (i < 8) {
                         *ptr++ = 0x20;
-                    break;
-                    case '.':
-                        if (i < 8) {
-                            *ptr++ = 0x20;
-                            break;
-                        }
-                        path++;
-                    break;
-                    default:
+                        break;
+                    }
+                    // Skipping the dot doesn't fill a position
+                    path++;
+                    i--;
+                break;
+                default:
+                    // Short names are stored in upper case
+                    if (*path >= 'a' && *path <= 'z') {
+                        *ptr++ = *path++ - 'a' + 'A';
+                    } else {
                         *ptr++ = *path++;
-                }
+                    }
             }
         }
+    }
 
-        if (*path == '/' || *path == '\\') {
-            path++;
-        } else if(*path != '\0') {
-            return 0;
+    if (*path == '/' || *path == '\\') {
+        path++;
+    } else if(*path != '\0') {
+        return 0;
+    }
+
+    return path;
+}
+
+/**
+ * Hash of a name within a directory
+ */
+static inline uint32_t index_hash(uint32_t directory, const uint8_t *name) {
+    uint32_t hash = 2166136261u ^ directory;
+
+    for (int i = 0; i < 11; i++)
+        hash = (hash ^ name[i]) * 16777619u;
+
+    return hash;
+}
+
+/**
+ * Forget everything that has been indexed
+ */
+static void index_reset(struct FATDirectoryIndex *index) {
+    memory_set(index->slots, 0, index->numberOfSlots * sizeof(struct FATIndexEntry));
+    index->used = 0;
+    index->numberOfDirectories = 0;
+}
+
+/**
+ * Test if all entries of the directory are in the index
+ */
+static inline int index_has_directory(struct FATDirectoryIndex *index, uint32_t directory) {
+    for (uint32_t i = 0; i < index->numberOfDirectories; i++) {
+        if (index->directories[i] == directory)
+            return 1;
+    }
+
+    return 0;
+}
+
+/**
+ * Record where an entry is found. When the index is full everything is
+ * dropped, and 0 is returned so the caller stops recording.
+ */
+static int index_insert(struct FATDirectoryIndex *index, uint32_t directory, const uint8_t *name, uint32_t sector, uint32_t offset) {
+    // Keep a quarter free, otherwise probing gets too long
+    if (index->used + 1 > index->numberOfSlots / 4 * 3) {
+        index_reset(index);
+        return 0;
+    }
+
+    uint32_t hash = index_hash(directory, name);
+    uint32_t mask = index->numberOfSlots - 1;
+    uint32_t slot = hash & mask;
+
+    while (index->slots[slot].sector != 0)
+        slot = (slot + 1) & mask;
+
+    index->slots[slot].directory = directory;
+    index->slots[slot].sector = sector;
+    index->slots[slot].offset = offset;
+    index->slots[slot].hash = hash >> 16;
+    index->used++;
+    return 1;
+}
+
+/**
+ * Look up an entry in the index. Returns -1 when the directory isn't indexed
+ * and FAT_ERR_FAILED_READ when the sector of a candidate can't be read.
+ */
+static int index_find(struct FATContext *ctx, uint32_t directory, const uint8_t *name, struct FATDirectoryEntry *entry) {
+    struct FATDirectoryIndex *index = ctx->index;
+
+    if (!index_has_directory(index, directory))
+        return -1;
+
+    uint32_t hash = index_hash(directory, name);
+    uint32_t mask = index->numberOfSlots - 1;
+    uint32_t slot = hash & mask;
+
+    // Sector 0 is never part of a directory so it marks an empty slot
+    for (; index->slots[slot].sector != 0; slot = (slot + 1) & mask) {
+        register struct FATIndexEntry *candidate = index->slots + slot;
+
+        if (candidate->directory != directory || candidate->hash != (hash >> 16))
+            continue;
+
+        if (ctx->device->read(ctx->device, candidate->sector, 1, ctx->buffer) != 1)
+            return FAT_ERR_FAILED_READ;
+
+        struct FATDirectoryEntry *cursor = ((struct FATDirectoryEntry*)ctx->buffer) + candidate->offset;
+        if (memory_compare(name, cursor->name, 11) == 0) {
+            memory_copy(entry, cursor, sizeof(struct FATDirectoryEntry));
+            return 1;
         }
     }
 
+    return 0;
+}
+
+/**
+ * Searches a single directory for the entry with the name. When the index is
+ * enabled the whole directory is scanned the first time, so it can be
+ * indexed. Returns FAT_ERR_FAILED_READ when the index couldn't be checked.
+ */
+static int find_entry(struct FATContext *ctx, uint32_t directory, const uint8_t *name, struct FATDirectoryEntry *entry) {
+    struct FATDirectoryIndex *index = ctx->index;
+    int found;
+
+    // An indexed directory is never scanned again, that would index it twice
+    if (index && (found = index_find(ctx, directory, name, entry)) != -1)
+        return found;
+
+    int indexing = 0;
+    if (index) {
+        // Start over when it can't keep track of more directories
+        if (index->numberOfDirectories >= FAT_INDEX_DIRECTORIES)
+            index_reset(index);
+
+        indexing = 1;
+    }
+
+    struct FATDirectoryReader reader;
+    reader.clusterIndex = directory;
+    found = 0;
+
     do {
-        if(!fat_directory_reader_read(ctx, &reader))
+        if(!fat_directory_reader_read(ctx, &reader)) {
+            if (indexing)
+                index_reset(index);
             return 0;
-        
+        }
+
+        uint32_t entriesPerSector = ctx->header->bytesPerSector / 32;
         register struct FATDirectoryEntry *cursor = ctx->buffer;
 
-        for (uint32_t index = 0; index < reader.entriesCount; index++, cursor++) {
+        for (uint32_t offset = 0; offset < reader.entriesCount; offset++, cursor++) {
             // This search method is for the short name so skip these
             if ((cursor->attributes.value & FAT_ATTR_LONG_NAME) == FAT_ATTR_LONG_NAME)
                 continue;
 
             // End readed
             if (cursor->name[0] == 0)
-                break;
+                goto end;
 
             // Entry is empty
             if (cursor->name[0] == 0xE5)
                 continue;
 
-            if (hasPath) {
-                if (memory_compare(segment, cursor->name, 11) == 0) {
-                    if (cursor->attributes.directory) {
-                        reader.clusterIndex = cursor->firstClusterLowWord | (cursor->firstClusterHighWord << 16);
-                        goto next;
-                    } else {
-                        // When there more path to traverse we did't find it.
-                        if(*path)
-                            return 0;
+            if (indexing) {
+                uint32_t sector = reader.sectorIndex + offset / entriesPerSector;
+                indexing = index_insert(index, directory, cursor->name, sector, offset % entriesPerSector);
+            }
 
-                        if(size > 0)
-                            memory_copy(entries, cursor, sizeof(struct FATDirectoryEntry));
+            if (!found && memory_compare(name, cursor->name, 11) == 0) {
+                memory_copy(entry, cursor, sizeof(struct FATDirectoryEntry));
+                found = 1;
 
-                        return 1;
-                    }
-                }
-            } else {
-                if(count < size)
-                    memory_copy(entries + count, cursor, sizeof(struct FATDirectoryEntry));
-                                    
-                count++;
+                if (!indexing)
+                    return 1;
             }
         }
     } while (fat_directory_reader_next(ctx, &reader));
 
-    // We can safely return count when we haven't found the file
-    // we were looking for. The counter only gets incremented
-    // when the last segment pointed to a directory. Otherwise
-    // it stays untouched.
+    end:
+    if (indexing)
+        index->directories[index->numberOfDirectories++] = directory;
+
+    return found;
+}
+
+/**
+ * Positions the iterator at the first entry of the directory
+ */
+static int directory_open(struct FATContext *ctx, struct FATDirectory *directory, uint32_t cluster) {
+    directory->reader.clusterIndex = cluster;
+    directory->sector = 0;
+    directory->entry = 0;
+    directory->ended = 0;
+
+    fat_directory_reader_start(ctx, &directory->reader);
+
+    if (ctx->device->read(ctx->device, directory->reader.sectorIndex, 1, directory->data) != 1)
+        return FAT_ERROR;
+
+    return FAT_SUCCESS;
+}
+
+/**
+ * Copies all entries of a directory up to size, and counts them all
+ */
+static int32_t list_entries(struct FATContext *ctx, uint32_t cluster, struct FATDirectoryEntry *entries, int32_t size) {
+    struct FATDirectory directory;
+    struct FATDirectoryEntry entry;
+    int32_t count = 0;
+
+    directory.data = ctx->buffer;
+    if (directory_open(ctx, &directory, cluster) != FAT_SUCCESS)
+        return 0;
+
+    while (fat_read_directory(ctx, &directory, &entry)) {
+        if(count < size)
+            memory_copy(entries + count, &entry, sizeof(struct FATDirectoryEntry));
+
+        count++;
+    }
+
     return count;
-}
\ No newline at end of file
+}
+
+/**
+ * Find the cached path that covers most of the segments
+ */
+static struct FATPathEntry *path_lookup(struct FATPathCache *cache, const uint8_t *names, uint32_t depth) {
+    struct FATPathEntry *found = 0;
+
+    for (uint32_t i = 0; i < cache->numberOfEntries; i++) {
+        struct FATPathEntry *candidate = cache->entries + i;
+
+        if (candidate->depth == 0 || candidate->depth > depth)
+            continue;
+
+        if (found && candidate->depth <= found->depth)
+            continue;
+
+        if (memory_compare(candidate->names, names, candidate->depth * 11) == 0)
+            found = candidate;
+    }
+
+    if (found)
+        found->lastUsed = ++cache->clock;
+
+    return found;
+}
+
+/**
+ * Remember the entry a path resolved to, replacing the least recently used one
+ */
+static void path_insert(struct FATPathCache *cache, const uint8_t *names, uint32_t depth, uint32_t parent, struct FATDirectoryEntry *entry) {
+    struct FATPathEntry *victim = cache->entries;
+
+    for (uint32_t i = 0; i < cache->numberOfEntries && victim->depth != 0; i++) {
+        if (cache->entries[i].depth == 0 || cache->entries[i].lastUsed < victim->lastUsed)
+            victim = cache->entries + i;
+    }
+
+    memory_copy(victim->names, names, depth * 11);
+    memory_copy(&victim->entry, entry, sizeof(struct FATDirectoryEntry));
+    victim->depth = depth;
+    victim->parent = parent;
+    victim->lastUsed = ++cache->clock;
+}
+
+int fat_enable_directory_index(struct FATContext *ctx, size_t size) {
+    if (ctx->index)
+        return FAT_SUCCESS;
+
+    // The number of slots must be a power of 2
+    uint32_t slots = 16;
+    while (sizeof(struct FATDirectoryIndex) + slots * 2 * sizeof(struct FATIndexEntry) <= size)
+        slots*= 2;
+
+    size = sizeof(struct FATDirectoryIndex) + slots * sizeof(struct FATIndexEntry);
+    size_t clusterSize = ctx->header->sectorsPerCluster * ctx->header->bytesPerSector;
+
+    if (size + clusterSize + sizeof(uint32_t) > ctx->bufferSize)
+        return FAT_ERR_MINIMUM_SIZE;
+
+    ctx->index = reserve(ctx, sizeof(struct FATDirectoryIndex));
+    ctx->index->numberOfSlots = slots;
+    ctx->index->slots = reserve(ctx, slots * sizeof(struct FATIndexEntry));
+    index_reset(ctx->index);
+
+    return FAT_SUCCESS;
+}
+
+int fat_enable_path_cache(struct FATContext *ctx, uint32_t count) {
+    if (ctx->paths)
+        return FAT_SUCCESS;
+
+    size_t size = sizeof(struct FATPathCache) + count * sizeof(struct FATPathEntry);
+    size_t clusterSize = ctx->header->sectorsPerCluster * ctx->header->bytesPerSector;
+
+    if (count == 0 || size + clusterSize + sizeof(uint32_t) > ctx->bufferSize)
+        return FAT_ERR_MINIMUM_SIZE;
+
+    ctx->paths = reserve(ctx, sizeof(struct FATPathCache));
+    ctx->paths->numberOfEntries = count;
+    ctx->paths->clock = 0;
+    ctx->paths->entries = reserve(ctx, count * sizeof(struct FATPathEntry));
+    memory_set(ctx->paths->entries, 0, count * sizeof(struct FATPathEntry));
+
+    return FAT_SUCCESS;
+}
+
+void fat_invalidate_directory(struct FATContext *ctx, uint32_t cluster) {
+    if (cluster == 0 && ctx->extended)
+        cluster = ctx->extended->rootCluster;
+
+    // Entries can't be taken out of the table one by one without breaking
+    // the probing, so a changed directory drops everything
+    if (ctx->index && index_has_directory(ctx->index, cluster))
+        index_reset(ctx->index);
+
+    // Paths below a changed entry may be gone too, so forget them all
+    if (ctx->paths) {
+        for (uint32_t i = 0; i < ctx->paths->numberOfEntries; i++) {
+            if (ctx->paths->entries[i].depth != 0 && ctx->paths->entries[i].parent == cluster) {
+                memory_set(ctx->paths->entries, 0, ctx->paths->numberOfEntries * sizeof(struct FATPathEntry));
+                break;
+            }
+        }
+    }
+}
+
+/**
+ * Walks the path, returns 1 when it ends at a file with its entry, 2 when it
+ * ends at a directory with its cluster, 0 when not found and
+ * FAT_ERR_FAILED_READ when a directory couldn't be read.
+ */
+static int resolve_path(struct FATContext *ctx, const char *path, struct FATDirectoryEntry *entry, uint32_t *directory) {
+    uint32_t root = ctx->extended ? ctx->extended->rootCluster : 0;
+    uint8_t names[FAT_PATH_DEPTH * 11];
+    uint8_t overflow[11];
+    const char *rest[FAT_PATH_DEPTH];
+    uint32_t parsed = 0;
+    uint32_t depth = 0;
+
+    // Continue from the longest part of the path that is already resolved
+    if (ctx->paths) {
+        const char *cursor = path;
+
+        while (parsed < FAT_PATH_DEPTH) {
+            while (*cursor == '/' || *cursor == '\\')
+                cursor++;
+
+            if (*cursor == '\0')
+                break;
+
+            if ((cursor = fat_parse_segment(cursor, names + parsed * 11)) == 0)
+                return 0;
+
+            rest[parsed++] = cursor;
+        }
+
+        struct FATPathEntry *cached = path_lookup(ctx->paths, names, parsed);
+        if (cached) {
+            memory_copy(entry, &cached->entry, sizeof(struct FATDirectoryEntry));
+            depth = cached->depth;
+            path = rest[depth - 1];
+        }
+    }
+
+    for (;;) {
+        if (depth == 0) {
+            *directory = root;
+        } else if (entry->attributes.directory) {
+            *directory = entry->firstClusterLowWord | (entry->firstClusterHighWord << 16);
+
+            // A ".." pointing to the root uses 0
+            if (*directory == 0)
+                *directory = root;
+        } else {
+            // When there more path to traverse we did't find it.
+            return *path ? 0 : 1;
+        }
+
+        // Remove any traling slashes
+        while (*path == '/' || *path == '\\') 
+            path++;
+
+        // When all segments are traversed we ended in a directory
+        if (*path == '\0')
+            return 2;
+
+        uint8_t *segment = depth < FAT_PATH_DEPTH ? names + depth * 11 : overflow;
+
+        if (depth < parsed) {
+            path = rest[depth];
+        } else if ((path = fat_parse_segment(path, segment)) == 0) {
+            return 0;
+        }
+
+        int found = find_entry(ctx, *directory, segment, entry);
+        if (found <= 0)
+            return found;
+
+        if (ctx->paths && depth < FAT_PATH_DEPTH)
+            path_insert(ctx->paths, names, depth + 1, *directory, entry);
+
+        depth++;
+    }
+}
+
+/**
+ * When it find the file it will return it entry, when it has a long name and size would
+ * fit the name, the entries will be filled with does entries, otherwise it will return
+ * only the entry with the dos name. When file found is a directory it will load the
+ * entries of the directory up to the size.
+ * 
+ *  @param ctx 		The context
+ *  @param entries 	Pointer to single entry or array of entries
+ *  @param size 	Size available in the entries
+ *  @param path 	A null-delimited string with the short entry path to be found
+ *  @return Number of entries found
+ */
+int32_t fat_find_file(struct FATContext *ctx, struct FATDirectoryEntry *entries, int32_t size, const char *path) {
+    struct FATDirectoryEntry entry;
+    uint32_t directory;
+
+    int resolved = resolve_path(ctx, path, &entry, &directory);
+    switch (resolved) {
+        case 1:
+            if(size > 0)
+                memory_copy(entries, &entry, sizeof(struct FATDirectoryEntry));
+
+            return 1;
+        case 2:
+            return list_entries(ctx, directory, entries, size);
+    }
+
+    return resolved < 0 ? resolved : 0;
+}
+
+int fat_find_entry(struct FATContext *ctx, struct FATDirectoryEntry *entry, const char *path) {
+    uint32_t directory;
+    int resolved = resolve_path(ctx, path, entry, &directory);
+
+    return resolved < 0 ? resolved : resolved == 1;
+}
+
+size_t fat_directory_size(struct FATContext *ctx) {
+    return sizeof(struct FATDirectory) + ctx->header->bytesPerSector;
+}
+
+int fat_open_directory(struct FATContext *ctx, struct FATDirectory *directory, const char *path) {
+    struct FATDirectoryEntry entry;
+    uint32_t cluster;
+
+    int resolved = resolve_path(ctx, path, &entry, &cluster);
+    if (resolved < 0)
+        return resolved;
+
+    if (resolved != 2)
+        return FAT_ERROR;
+
+    directory->data = (void*)(directory + 1);
+    return directory_open(ctx, directory, cluster);
+}
+
+int fat_read_directory(struct FATContext *ctx, struct FATDirectory *directory, struct FATDirectoryEntry *entry) {
+    uint32_t entriesPerSector = ctx->header->bytesPerSector / 32;
+
+    while (!directory->ended) {
+        // Load the next sector, moving on to the next cluster when needed
+        if (directory->entry == entriesPerSector) {
+            directory->entry = 0;
+
+            if (++directory->sector == directory->reader.sectorCount) {
+                if (!fat_directory_reader_next(ctx, &directory->reader))
+                    break;
+
+                fat_directory_reader_start(ctx, &directory->reader);
+                directory->sector = 0;
+            }
+
+            if (ctx->device->read(ctx->device, directory->reader.sectorIndex + directory->sector, 1, directory->data) != 1)
+                break;
+        }
+
+        struct FATDirectoryEntry *cursor = ((struct FATDirectoryEntry*)directory->data) + directory->entry++;
+
+        // This iterator is for the short name so skip these
+        if ((cursor->attributes.value & FAT_ATTR_LONG_NAME) == FAT_ATTR_LONG_NAME)
+            continue;
+
+        // End readed
+        if (cursor->name[0] == 0)
+            break;
+
+        // Entry is empty
+        if (cursor->name[0] == 0xE5)
+            continue;
+
+        memory_copy(entry, cursor, sizeof(struct FATDirectoryEntry));
+        return 1;
+    }
+
+    directory->ended = 1;
+    return 0;
+}
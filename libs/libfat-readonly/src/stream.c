@@ -0,0 +1,435 @@
+#include <fs/fat/readonly.h>
+#include <io/queue.h>
+#include <memory.h>
+
+// Number of extents of the chain looked up for a single read
+#define FAT_STREAM_EXTENTS 8
+
+struct FATFileStream {
+    stream_t stream;
+    struct FATContext *ctx;
+    uint32_t firstCluster;
+    uint32_t fileSize;
+    uint32_t position;
+    uint32_t cluster;
+    uint32_t clusterStart;
+    uint32_t *checkpoints;
+    uint32_t numberOfCheckpoints;
+    uint32_t knownCheckpoints;
+    uint32_t interval;
+    uint8_t *readahead;
+    uint32_t capacity;
+    uint32_t window;
+    uint32_t bufferStart;
+    uint32_t bufferLength;
+    uint32_t consumed;
+    uint32_t expected;
+    struct BlockQueue *queue;
+    struct BlockRequest requests[FAT_STREAM_EXTENTS];
+};
+
+/**
+ * Reads the whole clusters of the extents. With a queue every piece of the
+ * chain is submitted before waiting, so they're on their way at once.
+ */
+static size_t read_extents(struct FATFileStream *file, const struct FATExtent *extents, int32_t count, void *dst, size_t size) {
+    struct FATContext *ctx = file->ctx;
+    uint32_t sectorsPerCluster = ctx->header->sectorsPerCluster;
+    uint32_t bytesPerSector = ctx->header->bytesPerSector;
+    size_t clusterSize = sectorsPerCluster * bytesPerSector;
+    size_t offset = 0;
+    int32_t used = 0;
+
+    if (file->queue == 0)
+        return fat_read_extents(ctx, extents, count, dst, size);
+
+    for (; used < count && offset < size; used++) {
+        uint32_t clusters = (size - offset) / clusterSize;
+        if (clusters > extents[used].length)
+            clusters = extents[used].length;
+
+        struct BlockRequest *request = file->requests + used;
+        request->index      = ctx->startOfData + (extents[used].cluster - 2) * sectorsPerCluster;
+        request->count      = clusters * sectorsPerCluster;
+        request->address    = dst + offset;
+        request->write      = 0;
+        request->complete   = 0;
+        request->data       = 0;
+
+        if (!block_queue_submit(file->queue, request))
+            break;
+
+        offset+= clusters * clusterSize;
+    }
+
+    if (!block_queue_finish(file->queue))
+        return 0;
+
+    // Only what was read before the first short request counts
+    size_t read = 0;
+    for (int32_t index = 0; index < used; index++) {
+        read+= file->requests[index].done * bytesPerSector;
+        if (file->requests[index].done != file->requests[index].count)
+            break;
+    }
+
+    return read;
+}
+
+/**
+ * Adapts the window to how much of the last prefetch was used. All of it
+ * means the reads are sequential and it may grow, less then half means most
+ * of it was wasted.
+ */
+static inline void adapt(struct FATFileStream *file, uint32_t clusterSize) {
+    if (file->bufferLength == 0)
+        return;
+
+    uint32_t used = (file->consumed + clusterSize - 1) / clusterSize;
+    uint32_t prefetched = (file->bufferLength + clusterSize - 1) / clusterSize;
+
+    if (used >= prefetched) {
+        file->window = file->window * 2 < file->capacity ? file->window * 2 : file->capacity;
+    } else if (used < prefetched / 2) {
+        file->window = file->window > 1 ? file->window / 2 : 1;
+    }
+
+    file->bufferLength = 0;
+    file->consumed = 0;
+}
+
+/**
+ * Record the checkpoints that fall in a run of clusters that follow each
+ * other, starting at the index within the file
+ */
+static inline void remember(struct FATFileStream *file, uint32_t index, uint32_t cluster, uint32_t length) {
+    while (file->knownCheckpoints < file->numberOfCheckpoints) {
+        uint32_t next = file->knownCheckpoints * file->interval;
+
+        if (next < index || next >= index + length)
+            break;
+
+        file->checkpoints[file->knownCheckpoints++] = cluster + (next - index);
+    }
+}
+
+/**
+ * Moves the cursor to the cluster holding the position, from where it is when
+ * that's before the position, otherwise from the closest checkpoint or the
+ * start of the chain
+ */
+static int locate(struct FATFileStream *file, uint32_t clusterSize) {
+    if (file->position < file->clusterStart) {
+        file->cluster = file->firstCluster;
+        file->clusterStart = 0;
+    }
+
+    // Jump to the closest checkpoint when it's further then the cursor
+    if (file->knownCheckpoints) {
+        uint32_t checkpoint = file->position / clusterSize / file->interval;
+        if (checkpoint >= file->knownCheckpoints)
+            checkpoint = file->knownCheckpoints - 1;
+
+        uint32_t start = checkpoint * file->interval * clusterSize;
+        if (start > file->clusterStart) {
+            file->cluster = file->checkpoints[checkpoint];
+            file->clusterStart = start;
+        }
+    }
+
+    while (file->position - file->clusterStart >= clusterSize) {
+        if (fat_is_eoc(file->ctx, file->cluster))
+            return 0;
+
+        file->cluster = fat_next_cluster(file->ctx, file->cluster);
+        file->clusterStart+= clusterSize;
+
+        if (file->checkpoints)
+            remember(file, file->clusterStart / clusterSize, file->cluster, 1);
+    }
+
+    return !fat_is_eoc(file->ctx, file->cluster);
+}
+
+/**
+ * Reads the window of clusters from the cursor on into the readahead buffer,
+ * each piece of the chain with a single read
+ */
+static int prefetch(struct FATFileStream *file, uint32_t clusterSize) {
+    struct FATContext *ctx = file->ctx;
+    uint32_t cluster = file->cluster;
+    size_t wanted = file->window * clusterSize;
+    size_t filled = 0;
+
+    if (wanted > file->fileSize - file->clusterStart)
+        wanted = file->fileSize - file->clusterStart;
+
+    while (filled < wanted) {
+        struct FATExtent extents[FAT_STREAM_EXTENTS];
+        int32_t count = fat_get_extents(ctx, &cluster, extents, FAT_STREAM_EXTENTS);
+        if (count < 1)
+            break;
+
+        size_t bytes = 0;
+        for (int32_t index = 0; index < count; index++)
+            bytes+= extents[index].length * clusterSize;
+
+        if (bytes > wanted - filled)
+            bytes = wanted - filled;
+
+        // The last cluster of the file may be partial
+        size_t size = (bytes + clusterSize - 1) / clusterSize * clusterSize;
+        if (read_extents(file, extents, count, file->readahead + filled, size) != size)
+            break;
+
+        filled+= bytes;
+    }
+
+    file->bufferStart = file->clusterStart;
+    file->bufferLength = filled;
+    file->consumed = 0;
+    return filled != 0;
+}
+
+/**
+ * Moves to a new position, which may not be past the end of the file
+ */
+static int fat_file_stream_seek(stream_t *handle, size_t position, streamorigin_t origin) {
+    struct FATFileStream *file = (void*)handle;
+
+    switch (origin) {
+        case STREAM_SEEK_CURRENT:
+            position+= file->position;
+        break;
+        case STREAM_SEEK_END:
+            position+= file->fileSize;
+        break;
+        default:
+        break;
+    }
+
+    if (position > file->fileSize)
+        return 0;
+
+    file->position = position;
+    return 1;
+}
+
+static size_t fat_file_stream_tell(stream_t *handle) {
+    return ((struct FATFileStream*)handle)->position;
+}
+
+/**
+ * Reads from the current position, whole clusters that follow each other on
+ * the device are read in one go
+ */
+static size_t fat_file_stream_read(stream_t *handle, size_t size, void *address) {
+    struct FATFileStream *file = (void*)handle;
+    struct FATContext *ctx = file->ctx;
+    uint32_t bytesPerSector = ctx->header->bytesPerSector;
+    uint32_t clusterSize = ctx->header->sectorsPerCluster * bytesPerSector;
+    size_t read = 0;
+
+    if (size > file->fileSize - file->position)
+        size = file->fileSize - file->position;
+
+    while (read < size) {
+        size_t remaining = size - read;
+
+        // Whatever was prefetched already is served from memory
+        if (file->position >= file->bufferStart && file->position < file->bufferStart + file->bufferLength) {
+            uint32_t start = file->position - file->bufferStart;
+            size_t bytes = file->bufferLength - start;
+            if (bytes > remaining)
+                bytes = remaining;
+
+            memory_copy(address + read, file->readahead + start, bytes);
+            if (start + bytes > file->consumed)
+                file->consumed = start + bytes;
+
+            file->position+= bytes;
+            read+= bytes;
+            continue;
+        }
+
+        if (!locate(file, clusterSize))
+            break;
+
+        uint32_t offset = file->position - file->clusterStart;
+
+        // A read smaller then the window right after the last one, so the
+        // clusters after it are likely to be read next as well
+        if (file->readahead && file->position == file->expected && (offset != 0 || remaining < file->window * clusterSize)) {
+            adapt(file, clusterSize);
+
+            if (prefetch(file, clusterSize))
+                continue;
+        }
+
+        if (offset == 0 && remaining >= clusterSize) {
+            struct FATExtent extents[FAT_STREAM_EXTENTS];
+            uint32_t next = file->cluster;
+            int32_t count = fat_get_extents(ctx, &next, extents, FAT_STREAM_EXTENTS);
+
+            if (count < 1)
+                break;
+
+            // Only the whole clusters, so the cursor stays at the start of one
+            size_t bytes = 0;
+            for (int32_t index = 0; index < count; index++)
+                bytes+= extents[index].length * clusterSize;
+
+            if (bytes > remaining)
+                bytes = remaining - remaining % clusterSize;
+
+            size_t done = read_extents(file, extents, count, address + read, bytes);
+            if (done != bytes)
+                break;
+
+            // Move the cursor past the clusters that were read
+            uint32_t clusters = bytes / clusterSize;
+            uint32_t index = file->clusterStart / clusterSize;
+
+            for (int32_t extent = 0; extent < count && clusters; extent++) {
+                uint32_t length = extents[extent].length < clusters ? extents[extent].length : clusters;
+
+                if (file->checkpoints)
+                    remember(file, index, extents[extent].cluster, length);
+
+                if (length < extents[extent].length) {
+                    file->cluster = extents[extent].cluster + length;
+                } else {
+                    file->cluster = extent + 1 < count ? extents[extent + 1].cluster : next;
+                }
+
+                index+= length;
+                clusters-= length;
+            }
+
+            file->clusterStart+= bytes;
+            file->position+= bytes;
+            read+= bytes;
+
+            // The cluster the cursor lands on may be one as well
+            if (file->checkpoints && !fat_is_eoc(ctx, file->cluster))
+                remember(file, file->clusterStart / clusterSize, file->cluster, 1);
+            continue;
+        }
+
+        // Part of a cluster, only the sectors that are needed go through the buffer
+        size_t bytes = clusterSize - offset;
+        if (bytes > remaining)
+            bytes = remaining;
+
+        uint32_t first = offset / bytesPerSector;
+        uint32_t count = (offset + bytes + bytesPerSector - 1) / bytesPerSector - first;
+        uint32_t sectorIndex = ctx->startOfData + (file->cluster - 2) * ctx->header->sectorsPerCluster + first;
+
+        if (ctx->device->read(ctx->device, sectorIndex, count, ctx->buffer) != count)
+            break;
+
+        memory_copy(address + read, ctx->buffer + offset % bytesPerSector, bytes);
+        file->position+= bytes;
+        read+= bytes;
+    }
+
+    file->expected = file->position;
+    return read;
+}
+
+/**
+ * The read only library can't write
+ */
+static size_t fat_file_stream_write(stream_t*, size_t, const void*) {
+    return 0;
+}
+
+static int fat_file_stream_close(stream_t*) {
+    return 1;
+}
+
+size_t fat_file_stream_size() {
+    return sizeof(struct FATFileStream);
+}
+
+int fat_open_file(struct FATContext *ctx, stream_t *stream, const char *path) {
+    struct FATDirectoryEntry entry;
+    int found = fat_find_entry(ctx, &entry, path);
+
+    if (found < 0)
+        return found;
+
+    if (found == 0)
+        return FAT_ERROR;
+
+    struct FATFileStream *file = (void*)stream;
+    file->stream.size   = sizeof(struct FATFileStream);
+    file->stream.seek   = fat_file_stream_seek;
+    file->stream.tell   = fat_file_stream_tell;
+    file->stream.read   = fat_file_stream_read;
+    file->stream.write  = fat_file_stream_write;
+    file->stream.close  = fat_file_stream_close;
+    file->ctx           = ctx;
+    file->firstCluster  = entry.firstClusterLowWord | (entry.firstClusterHighWord << 16);
+    file->fileSize      = entry.fileSize;
+    file->position      = 0;
+    file->cluster       = file->firstCluster;
+    file->clusterStart  = 0;
+    file->checkpoints   = 0;
+    file->numberOfCheckpoints = 0;
+    file->knownCheckpoints = 0;
+    file->interval      = 0;
+    file->readahead     = 0;
+    file->capacity      = 0;
+    file->window        = 0;
+    file->bufferStart   = 0;
+    file->bufferLength  = 0;
+    file->consumed      = 0;
+    file->expected      = 0;
+    file->queue         = 0;
+
+    return FAT_SUCCESS;
+}
+
+int fat_file_stream_checkpoints(stream_t *stream, uint32_t *checkpoints, uint32_t count, uint32_t interval) {
+    struct FATFileStream *file = (void*)stream;
+
+    if (count == 0 || interval == 0)
+        return FAT_ERROR;
+
+    file->checkpoints = checkpoints;
+    file->numberOfCheckpoints = count;
+    file->interval = interval;
+
+    // The first cluster is always known, the rest is filled in while reading
+    file->checkpoints[0] = file->firstCluster;
+    file->knownCheckpoints = 1;
+
+    return FAT_SUCCESS;
+}
+
+int fat_file_stream_readahead(stream_t *stream, void *buffer, size_t size) {
+    struct FATFileStream *file = (void*)stream;
+    struct FATContext *ctx = file->ctx;
+    uint32_t clusterSize = ctx->header->sectorsPerCluster * ctx->header->bytesPerSector;
+
+    if (size < clusterSize)
+        return FAT_ERROR;
+
+    file->readahead = buffer;
+    file->capacity = size / clusterSize;
+    file->bufferLength = 0;
+    file->consumed = 0;
+
+    // Starts small, sequential reads make it grow
+    file->window = file->capacity < 2 ? file->capacity : 2;
+
+    return FAT_SUCCESS;
+}
+
+int fat_file_stream_queue(stream_t *stream, struct BlockQueue *queue) {
+    struct FATFileStream *file = (void*)stream;
+
+    file->queue = queue;
+    return FAT_SUCCESS;
+}
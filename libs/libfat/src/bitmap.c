@@ -0,0 +1,210 @@
+#include <fs/fat.h>
+#include <memory.h>
+
+/**
+ * Number of bits set, without relying on a popcount instruction
+ */
+static inline uint32_t count_bits(uint32_t value) {
+    value = value - ((value >> 1) & 0x55555555);
+    value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+    value = (value + (value >> 4)) & 0x0F0F0F0F;
+    return (value * 0x01010101) >> 24;
+}
+
+/**
+ * Number of words in the bitmap
+ */
+static inline uint32_t map_words(struct FATContext *ctx) {
+    return (ctx->numberOfClusters + 2 + 31) / 32;
+}
+
+/**
+ * First free cluster from index, or limit when there is none before it
+ */
+static inline uint32_t next_free(struct FATContext *ctx, uint32_t index, uint32_t limit) {
+    while (index < limit) {
+        uint32_t bits = ctx->freeMap[index / 32] >> (index & 31);
+
+        if (bits) {
+            index+= __builtin_ctz(bits);
+            return index < limit ? index : limit;
+        }
+
+        index = (index | 31) + 1;
+    }
+
+    return limit;
+}
+
+/**
+ * First cluster in use from index, or limit when there is none before it
+ */
+static inline uint32_t next_used(struct FATContext *ctx, uint32_t index, uint32_t limit) {
+    while (index < limit) {
+        uint32_t bits = ~ctx->freeMap[index / 32] >> (index & 31);
+
+        if (bits) {
+            index+= __builtin_ctz(bits);
+            return index < limit ? index : limit;
+        }
+
+        index = (index | 31) + 1;
+    }
+
+    return limit;
+}
+
+size_t fat_free_map_size(struct FATContext *ctx) {
+    return map_words(ctx) * sizeof(uint32_t);
+}
+
+int fat_enable_free_map(struct FATContext *ctx, uint32_t *map, size_t size) {
+    uint32_t words = map_words(ctx);
+
+    if (size < words * sizeof(uint32_t))
+        return FAT_ERR_MINIMUM_SIZE;
+
+    memory_set(map, 0, words * sizeof(uint32_t));
+
+    for (uint32_t index = 2; index < ctx->numberOfClusters + 2; index++) {
+        if (fat_next_cluster(ctx, index) == 0)
+            map[index / 32]|= 1u << (index & 31);
+    }
+
+    ctx->freeMap = map;
+    return FAT_SUCCESS;
+}
+
+uint32_t fat_count_free(struct FATContext *ctx) {
+    uint32_t words = map_words(ctx);
+    uint32_t count = 0;
+
+    if (ctx->freeMap == 0)
+        return 0;
+
+    for (uint32_t word = 0; word < words; word++)
+        count+= count_bits(ctx->freeMap[word]);
+
+    return count;
+}
+
+uint32_t fat_find_free(struct FATContext *ctx, uint32_t start) {
+    uint32_t words = map_words(ctx);
+
+    if (ctx->freeMap == 0)
+        return 0;
+
+    if (start < 2 || start >= ctx->numberOfClusters + 2)
+        start = 2;
+
+    // The first word only counts from start, and is visited again at the end
+    // for the part before it
+    uint32_t word = start / 32;
+    uint32_t bits = ctx->freeMap[word] & (0xFFFFFFFF << (start & 31));
+
+    for (uint32_t visited = 0; visited <= words; visited++) {
+        if (bits)
+            return word * 32 + __builtin_ctz(bits);
+
+        word = word + 1 < words ? word + 1 : 0;
+        bits = ctx->freeMap[word];
+    }
+
+    return 0;
+}
+
+uint32_t fat_find_free_run(struct FATContext *ctx, uint32_t start, uint32_t length) {
+    uint32_t words = map_words(ctx);
+    uint32_t end = ctx->numberOfClusters + 2;
+
+    if (ctx->freeMap == 0 || length == 0)
+        return 0;
+
+    if (start < 2 || start >= end)
+        start = 2;
+
+    uint32_t runStart = 0;
+    uint32_t runLength = 0;
+
+    for (uint32_t word = start / 32; word < words; word++) {
+        uint32_t bits = ctx->freeMap[word];
+
+        if (word == start / 32)
+            bits&= 0xFFFFFFFF << (start & 31);
+
+        // Whole words can be skipped or added at once
+        if (bits == 0) {
+            runLength = 0;
+            continue;
+        }
+
+        if (bits == 0xFFFFFFFF) {
+            if (runLength == 0)
+                runStart = word * 32;
+
+            runLength+= 32;
+            if (runLength >= length)
+                return runStart;
+
+            continue;
+        }
+
+        for (uint32_t bit = 0; bit < 32; bit++) {
+            if (bits & (1u << bit)) {
+                if (runLength == 0)
+                    runStart = word * 32 + bit;
+
+                if (++runLength >= length)
+                    return runStart;
+            } else {
+                runLength = 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+uint32_t fat_find_best_run(struct FATContext *ctx, uint32_t start, uint32_t length, uint32_t *runLength) {
+    uint32_t end = ctx->numberOfClusters + 2;
+    uint32_t best = 0;
+    uint32_t bestLength = 0;
+
+    *runLength = 0;
+    if (ctx->freeMap == 0 || length == 0)
+        return 0;
+
+    if (start < 2 || start >= end)
+        start = 2;
+
+    // Back up to the start of the run the hint falls in, so no run is split
+    while (start > 2 && (ctx->freeMap[(start - 1) / 32] & (1u << ((start - 1) & 31))))
+        start--;
+
+    // From the hint to the end, then from the first cluster up to the hint
+    for (uint32_t pass = 0; pass < 2; pass++) {
+        uint32_t index = pass ? 2 : start;
+        uint32_t limit = pass ? start : end;
+
+        while ((index = next_free(ctx, index, limit)) < limit) {
+            uint32_t stop = next_used(ctx, index, limit);
+            uint32_t size = stop - index;
+
+            // The smallest run that fits, otherwise the largest there is
+            int better = size >= length ? bestLength < length || size < bestLength : size > bestLength;
+            if (better) {
+                best = index;
+                bestLength = size;
+
+                if (size == length)
+                    goto found;
+            }
+
+            index = stop;
+        }
+    }
+
+    found:
+    *runLength = bestLength;
+    return best;
+}
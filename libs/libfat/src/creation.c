@@ -29,26 +29,6 @@ static inline size_t label_length(uint8_t *name, size_t size){
     return length;
 }
 
-static inline void set_next_cluster(struct FATContext *ctx, uint32_t index, uint32_t next) {
-    switch (ctx->type) {
-        case FAT12:
-            uint16_t *ptr = ctx->fat + (index + index / 2);
-
-            if (index & 1) {
-                *ptr = (*ptr & 0x000F) | ((next & 0xFFF) << 4);
-            } else {
-                *ptr = (*ptr & 0xF000) | (next & 0xFFF);
-            }
-        break;
-        case FAT16:
-            ((uint16_t*)ctx->fat)[index] = next;
-        break;
-        case FAT32:
-            ((uint32_t*)ctx->fat)[index] = next;
-        break;
-    }
-}
-
 static inline void sanitize_parameters(const struct BlockDevice *device, struct FATCreateParams *parameters){
     // Valid values are 512, 1024, 2048, 4096. But I only care
     // that it's not zero
@@ -56,10 +36,6 @@ static inline void sanitize_parameters(const struct BlockDevice *device, struct
         // header->bytesPerSector = 512;
         parameters->bytesPerSector = device->blockSize;
 
-    // A minumum of 1 is required as this header resides in it
-    if(parameters->reservedSectors == 0)
-        parameters->reservedSectors = 1;
-
     // We could check to a minimum. But if some wants to set this
     // to 1, I won't judge.
     if (parameters->numberOfRootEntries == 0)
@@ -74,12 +50,6 @@ static inline void sanitize_parameters(const struct BlockDevice *device, struct
     if (parameters->sectorsPerCluster == 0)
         parameters->sectorsPerCluster = 2;
 
-    if (parameters->sectorsPerFat == 0) {
-        // This is a rough estimate, but at least it will fit
-        uint32_t numberOfClusters = parameters->numberOfSectors / parameters->sectorsPerCluster;
-        parameters->sectorsPerFat = ((numberOfClusters * 4) + parameters->bytesPerSector - 1) / parameters->bytesPerSector;
-    }
-
     // Make sure it's padded with spaces
     fix_label(parameters->oemName, 8);
     
@@ -95,6 +65,56 @@ static inline void sanitize_parameters(const struct BlockDevice *device, struct
         parameters->mediaDescriptor = 0xF0;
 }
 
+/**
+ * Writes zeros to a range of sectors, as much at once as the buffer allows
+ */
+static int zero_sectors(struct FATContext *ctx, uint32_t sectorIndex, uint32_t count) {
+    uint32_t bytesPerSector = ctx->header->bytesPerSector;
+    uint32_t chunk = ctx->bufferSize / bytesPerSector;
+
+    if (chunk == 0)
+        return FAT_ERR_MINIMUM_SIZE;
+
+    memory_set(ctx->buffer, 0, (count < chunk ? count : chunk) * bytesPerSector);
+
+    while (count > 0) {
+        uint32_t sectors = count < chunk ? count : chunk;
+
+        if (ctx->device->write(ctx->device, sectorIndex, sectors, ctx->buffer) != sectors)
+            return FAT_ERROR;
+
+        sectorIndex+= sectors;
+        count-= sectors;
+    }
+
+    return FAT_SUCCESS;
+}
+
+/**
+ * Fills in the first entries of a table in the sector, which are the media
+ * descriptor, a EOC mark and on FAT32 the EOC of the root directory
+ */
+static void first_table_sector(enum FATType type, uint8_t mediaDescriptor, void *sector, size_t size) {
+    memory_set(sector, 0, size);
+
+    switch (type) {
+        case FAT12:
+            ((uint8_t*)sector)[0] = mediaDescriptor;
+            ((uint8_t*)sector)[1] = 0xFF;
+            ((uint8_t*)sector)[2] = 0xFF;
+        break;
+        case FAT16:
+            ((uint16_t*)sector)[0] = 0xFF00 | mediaDescriptor;
+            ((uint16_t*)sector)[1] = 0xFFFF;
+        break;
+        case FAT32:
+            ((uint32_t*)sector)[0] = 0x0FFFFF00 | mediaDescriptor;
+            ((uint32_t*)sector)[1] = 0x0FFFFFFF;
+            ((uint32_t*)sector)[2] = 0x0FFFFFFF;
+        break;
+    }
+}
+
 int fat_create(struct FATContext *ctx, size_t size, const struct BlockDevice *device, struct FATCreateParams *parameters) {
     // This is a bit of a mandatory
     if (parameters->numberOfSectors == 0)
@@ -102,15 +122,26 @@ int fat_create(struct FATContext *ctx, size_t size, const struct BlockDevice *de
 
     sanitize_parameters(device, parameters);
 
+    // A minumum of 1 is required as this header resides in it, FAT32 wants
+    // room for the FSInfo and a backup of the boot sector
+    uint32_t reservedSectors = parameters->reservedSectors ? parameters->reservedSectors : 1;
+
+    // This is a rough estimate, but at least it will fit. On large volumes it
+    // doesn't fit the 16 bit field, so it's kept here.
+    uint32_t sectorsPerFat = parameters->sectorsPerFat;
+    if (sectorsPerFat == 0) {
+        uint32_t numberOfClusters = parameters->numberOfSectors / parameters->sectorsPerCluster;
+        sectorsPerFat = (((numberOfClusters + 2) * 4) + parameters->bytesPerSector - 1) / parameters->bytesPerSector;
+    }
 
     // The sector size of the all the fat copies
-    uint32_t fatSize = parameters->sectorsPerFat * parameters->numberOfFatCopies;
+    uint32_t fatSize = sectorsPerFat * parameters->numberOfFatCopies;
     
     // The sector size of the root directory (required bytes rounded up to the nearest sector size)
     uint32_t rootSize = ((parameters->numberOfRootEntries * 32) + parameters->bytesPerSector - 1) / parameters->bytesPerSector;
 
     // The data area starts right after the root directory
-    uint32_t startOfData = parameters->reservedSectors + fatSize + rootSize;
+    uint32_t startOfData = reservedSectors + fatSize + rootSize;
 
     // Now we can calculate the sector size of the data area and divide it by the sectors per
     // cluster, to get the number of clusters
@@ -127,18 +158,42 @@ int fat_create(struct FATContext *ctx, size_t size, const struct BlockDevice *de
         type = FAT16;
     } else {
         type = FAT32;
+
+        if (parameters->reservedSectors == 0)
+            reservedSectors = 32;
+
         // FAT32 doesn't have a fixed root directory
-        startOfData-= rootSize;
+        startOfData = reservedSectors + fatSize;
+        if (startOfData >= parameters->numberOfSectors)
+            return FAT_ERR_MINIMUM_SIZE;
+
+        // With the larger reserved area it may end up with too few clusters
+        // for FAT32, while it has too many for FAT16
         numberOfClusters = (parameters->numberOfSectors - startOfData) / parameters->sectorsPerCluster;
+        if (numberOfClusters < 65525)
+            return FAT_ERR_INVALID_FAT32;
+    }
+
+    if (startOfData >= parameters->numberOfSectors)
+        return FAT_ERR_MINIMUM_SIZE;
+
+    // The table must be able to hold every cluster
+    if (type != FAT32) {
+        if (sectorsPerFat > 0xFFFF)
+            sectorsPerFat = ((numberOfClusters + 2) * 2 + parameters->bytesPerSector - 1) / parameters->bytesPerSector;
+
+        parameters->sectorsPerFat = sectorsPerFat;
     }
 
+    parameters->reservedSectors = reservedSectors;
+
 
     // ----------------------------------//
     // TODO: validate parameters
     // ----------------------------------//
 
-    // Make sure context is large enough
-    if (size < device->blockSize)
+    // Make sure context is large enough, for the boot sector and the FSInfo
+    if (size < device->blockSize * 2)
         return FAT_ERR_MINIMUM_SIZE;
 
     // Read current bootSector to preserve possible code
@@ -159,51 +214,114 @@ int fat_create(struct FATContext *ctx, size_t size, const struct BlockDevice *de
         bpb->header.largeNumberOfSectors = parameters->numberOfSectors;
     }
 
+    struct FATBootSector *bootSector;
+    struct FATSignature *signature;
+
     if(type != FAT32){
-        bpb->fat1x.bootSector.driveNumber = parameters->driveNumber;
-
-        // According to specification a signature is not required, and
-        // mounting the image without it is not a problem. But we do
-        // include it otherwise tools like fsck.fat will complain.
-        bpb->fat1x.bootSector.extendedBootSignature = 0x29;
-
-        bpb->fat1x.signature.volumeSerialNumber = parameters->volumeSerialNumber;
-        if (label_length(parameters->volumeLabel, 11) == 0){
-            memory_copy(bpb->fat1x.signature.volumeLabel, "NO NAME    " , 11);
-        } else {
-            memory_copy(bpb->fat1x.signature.volumeLabel, parameters->volumeLabel, 11);
-        }
-        if(type == FAT12){
-            memory_copy(bpb->fat1x.signature.fileSystemType, "FAT12   ", 8);
-        } else {
-            memory_copy(bpb->fat1x.signature.fileSystemType, "FAT16   ", 8);
-        }
+        bootSector = &bpb->fat1x.bootSector;
+        signature = &bpb->fat1x.signature;
     } else {
-        // NOT YET SUPPORTED
-        return FAT_ERROR;
+        bootSector = &bpb->fat32.bootSector;
+        signature = &bpb->fat32.signature;
+
+        // These moved to the extended header
+        bpb->header.sectorsPerFat = 0;
+        bpb->header.numberOfRootEntries = 0;
+
+        memory_set(&bpb->fat32.extended, 0, sizeof(struct FATExtendedHeader));
+        bpb->fat32.extended.sectorsPerFat = sectorsPerFat;
+        bpb->fat32.extended.rootCluster = 2;
+        bpb->fat32.extended.fileSystemInfoSector = 1;
+
+        // The backup boot sector is followed by a backup of the FSInfo
+        bpb->fat32.extended.backupBootSector = reservedSectors >= 8 ? 6 : 0;
+    }
+
+    bootSector->driveNumber = parameters->driveNumber;
+    bootSector->reserved = 0;
+
+    // According to specification a signature is not required, and
+    // mounting the image without it is not a problem. But we do
+    // include it otherwise tools like fsck.fat will complain.
+    bootSector->extendedBootSignature = 0x29;
+
+    signature->volumeSerialNumber = parameters->volumeSerialNumber;
+    if (label_length(parameters->volumeLabel, 11) == 0){
+        memory_copy(signature->volumeLabel, "NO NAME    " , 11);
+    } else {
+        memory_copy(signature->volumeLabel, parameters->volumeLabel, 11);
+    }
+    switch (type) {
+        case FAT12: memory_copy(signature->fileSystemType, "FAT12   ", 8); break;
+        case FAT16: memory_copy(signature->fileSystemType, "FAT16   ", 8); break;
+        case FAT32: memory_copy(signature->fileSystemType, "FAT32   ", 8); break;
+    }
+
+    // The last reserved sector is where a log keeps its state, one left by
+    // a previous filesystem must not be replayed on this one
+    if (reservedSectors > 1) {
+        void *empty = ((void*)ctx) + device->blockSize;
+        memory_set(empty, 0, device->blockSize);
+
+        if (device->write(device, reservedSectors - 1, 1, empty) != 1)
+            return FAT_ERROR;
     }
 
     // Write it back to the device
-    device->write(device, 0, 1, ctx);
+    if (device->write(device, 0, 1, ctx) != 1)
+        return FAT_ERROR;
+
+    if (type == FAT32) {
+        // Only the root directory is in use
+        struct FATFileSystemInfo *info = ((void*)ctx) + device->blockSize;
+        memory_set(info, 0, device->blockSize);
+        info->leadSignature = FAT_FSINFO_LEAD_SIGNATURE;
+        info->structureSignature = FAT_FSINFO_STRUCTURE_SIGNATURE;
+        info->freeClusters = numberOfClusters - 1;
+        info->nextFree = 3;
+        info->trailSignature = FAT_FSINFO_TRAIL_SIGNATURE;
+
+        if (device->write(device, 1, 1, info) != 1)
+            return FAT_ERROR;
+
+        if (bpb->fat32.extended.backupBootSector) {
+            if (device->write(device, 6, 1, ctx) != 1 || device->write(device, 7, 1, info) != 1)
+                return FAT_ERROR;
+        }
+    }
 
     // Init the normal loading to get a fully functional context
     int resultCode;
     if ((resultCode = fat_init_context(ctx, size, device)) != FAT_SUCCESS)
         return resultCode;
 
-    if (ctx->fat == 0)
-        return FAT_ERROR;
+    // Only the tables and the root directory need to be cleared, the data
+    // area is taken as it is
+    if ((resultCode = zero_sectors(ctx, reservedSectors, fatSize)) != FAT_SUCCESS)
+        return resultCode;
 
-    // The upper bit/bytes need to be the same as an EOC mark. We
-    // can safely use the FAT32_EOC because trimmed down to 16 or
-    // 12 bit it will become there EOC mark values.
-    set_next_cluster(ctx, 0, 0x0FFFFF00 | parameters->mediaDescriptor);
-    set_next_cluster(ctx, 1, FAT32_EOC);
+    if (type == FAT32) {
+        resultCode = zero_sectors(ctx, ctx->startOfData, parameters->sectorsPerCluster);
+    } else {
+        resultCode = zero_sectors(ctx, ctx->startOfRootDirectory, rootSize);
+    }
 
-    device->write(device, ctx->header->reservedSectors, 1, ctx->fat);
-    device->write(device, ctx->header->reservedSectors + ctx->header->sectorsPerFat, 1, ctx->fat);
+    if (resultCode != FAT_SUCCESS)
+        return resultCode;
 
-    return FAT_SUCCESS;
+    // The first sector of the table is the only one that isn't empty, it's
+    // built in memory and flushed to every copy like any other change
+    if (ctx->fat)
+        memory_set(ctx->fat, 0, sectorsPerFat * ctx->header->bytesPerSector);
+
+    void *sector = fat_table_sector(ctx, 0);
+    if (sector == 0)
+        return FAT_ERROR;
+
+    first_table_sector(type, parameters->mediaDescriptor, sector, ctx->header->bytesPerSector);
+    fat_mark_table_dirty(ctx, 0, 1);
+
+    return fat_flush_table(ctx);
 }
 
 int fat_set_reserved(struct FATContext *ctx, uint32_t startIndex, uint32_t endIndex, const void *source, size_t size) {
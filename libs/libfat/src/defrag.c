@@ -0,0 +1,260 @@
+#include <fs/fat.h>
+#include <memory.h>
+
+#define END_OF_CHAIN    0x0FFFFFFF
+
+// Guards the walk against directories that loop back on themselves
+#define MAX_DEPTH       32
+
+/**
+ * Keeps track of the plan while walking the directories
+ */
+struct Planner {
+    struct FATDefragMove *moves;
+    uint32_t size;
+    uint32_t count;
+    uint32_t skipped;
+};
+
+static inline uint32_t cluster_sector(struct FATContext *ctx, uint32_t cluster) {
+    return ctx->startOfData + (cluster - 2) * ctx->header->sectorsPerCluster;
+}
+
+static inline uint32_t entry_cluster(struct FATDirectoryEntry *entry) {
+    return entry->firstClusterLowWord | (entry->firstClusterHighWord << 16);
+}
+
+/**
+ * Number of clusters in the chain and the number of pieces they're in
+ */
+static uint32_t count_fragments(struct FATContext *ctx, uint32_t cluster, uint32_t *length) {
+    uint32_t fragments = 1;
+
+    *length = 0;
+    for (uint32_t count = 0; count < ctx->numberOfClusters && !fat_is_eoc(ctx, cluster); count++) {
+        uint32_t next = fat_next_cluster(ctx, cluster);
+
+        if (next != cluster + 1 && !fat_is_eoc(ctx, next))
+            fragments++;
+
+        (*length)++;
+        cluster = next;
+    }
+
+    return fragments;
+}
+
+/**
+ * Adds the files of the directory and the ones below it to the plan, when
+ * there is a free run they fit in. The fragmented files that don't fit are
+ * counted as skipped.
+ */
+static void plan_directory(struct FATContext *ctx, struct Planner *planner, uint32_t directory, uint32_t depth) {
+    uint32_t entriesPerSector = ctx->header->bytesPerSector / 32;
+    uint32_t cluster = directory;
+
+    if (depth == MAX_DEPTH)
+        return;
+
+    for (uint32_t visited = 0; visited < ctx->numberOfClusters; visited++) {
+        uint32_t first, count;
+
+        if (cluster == 0) {
+            first = ctx->startOfRootDirectory;
+            count = ctx->startOfData - ctx->startOfRootDirectory;
+        } else {
+            first = cluster_sector(ctx, cluster);
+            count = ctx->header->sectorsPerCluster;
+        }
+
+        for (uint32_t sector = first; sector < first + count; sector++) {
+            for (uint32_t offset = 0; offset < entriesPerSector; offset++) {
+                if (planner->count == planner->size)
+                    return;
+
+                if (offset == 0 && ctx->device->read(ctx->device, sector, 1, ctx->buffer) != 1)
+                    return;
+
+                struct FATDirectoryEntry entry;
+                memory_copy(&entry, ((struct FATDirectoryEntry*)ctx->buffer) + offset, sizeof(struct FATDirectoryEntry));
+
+                if (entry.name[0] == 0)
+                    return;
+
+                if (entry.name[0] == 0xE5 || entry.name[0] == '.')
+                    continue;
+
+                if ((entry.attributes.value & FAT_ATTR_LONG_NAME) == FAT_ATTR_LONG_NAME || entry.attributes.volumeId)
+                    continue;
+
+                uint32_t start = entry_cluster(&entry);
+                if (start < 2 || start >= ctx->numberOfClusters + 2)
+                    continue;
+
+                // Walking a subdirectory uses the buffer, so it's read again
+                if (entry.attributes.directory) {
+                    plan_directory(ctx, planner, start, depth + 1);
+
+                    if (ctx->device->read(ctx->device, sector, 1, ctx->buffer) != 1)
+                        return;
+
+                    continue;
+                }
+
+                uint32_t length, runLength;
+                if (count_fragments(ctx, start, &length) == 1)
+                    continue;
+
+                if (fat_find_best_run(ctx, 2, length, &runLength) == 0 || runLength < length) {
+                    planner->skipped++;
+                    continue;
+                }
+
+                struct FATDefragMove *move = planner->moves + planner->count++;
+                move->directory = directory;
+                move->sector = sector;
+                move->offset = offset;
+                move->cluster = start;
+                move->length = length;
+            }
+        }
+
+        if (cluster == 0)
+            return;
+
+        cluster = fat_next_cluster(ctx, cluster);
+        if (fat_is_eoc(ctx, cluster))
+            return;
+    }
+}
+
+/**
+ * Copies the chain to a free run, returns the first cluster of the run or 0
+ * when it couldn't be moved. The old chain stays allocated.
+ */
+static uint32_t move_chain(struct FATContext *ctx, struct FATDefragMove *move, void *buffer, size_t bufferSize) {
+    uint32_t sectorsPerCluster = ctx->header->sectorsPerCluster;
+    size_t clusterSize = sectorsPerCluster * ctx->header->bytesPerSector;
+    uint32_t chunk = bufferSize / clusterSize;
+    uint32_t runLength;
+
+    // The free space changes with every move, so look again
+    uint32_t target = fat_find_best_run(ctx, 2, move->length, &runLength);
+    if (target == 0 || runLength < move->length)
+        return 0;
+
+    for (uint32_t index = target; index < target + move->length; index++) {
+        uint32_t next = index + 1 < target + move->length ? index + 1 : END_OF_CHAIN;
+
+        if (fat_set_next_cluster(ctx, index, next) != FAT_SUCCESS)
+            return 0;
+    }
+
+    uint32_t cluster = move->cluster;
+    uint32_t destination = target;
+    struct FATExtent extent;
+
+    while (destination < target + move->length && fat_get_extents(ctx, &cluster, &extent, 1) == 1) {
+        // Each piece is copied in chunks as big as the buffer allows
+        while (extent.length && destination < target + move->length) {
+            uint32_t clusters = extent.length < chunk ? extent.length : chunk;
+            uint32_t count = clusters * sectorsPerCluster;
+
+            if (ctx->device->read(ctx->device, cluster_sector(ctx, extent.cluster), count, buffer) != count)
+                goto error;
+
+            if (ctx->device->write(ctx->device, cluster_sector(ctx, destination), count, buffer) != count)
+                goto error;
+
+            extent.cluster+= clusters;
+            extent.length-= clusters;
+            destination+= clusters;
+        }
+    }
+
+    if (destination == target + move->length)
+        return target;
+
+    error:
+    for (uint32_t index = target; index < target + move->length; index++)
+        fat_set_next_cluster(ctx, index, 0);
+
+    return 0;
+}
+
+size_t fat_defrag_plan_size(uint32_t count) {
+    return count * sizeof(struct FATDefragMove);
+}
+
+int fat_defragment(struct FATContext *ctx, struct FATDefragMove *plan, size_t planSize, void *buffer, size_t bufferSize, uint32_t *moved, uint32_t *fragmented) {
+    size_t clusterSize = ctx->header->sectorsPerCluster * ctx->header->bytesPerSector;
+    struct Planner planner = { plan, planSize / sizeof(struct FATDefragMove), 0, 0 };
+
+    *moved = 0;
+    *fragmented = 0;
+    if (ctx->freeMap == 0 || planner.size == 0 || bufferSize < clusterSize)
+        return FAT_ERROR;
+
+    // Every pass plans what fits in the plan, the clusters freed by one pass
+    // can make room for files that didn't fit before
+    for (;;) {
+        uint32_t done = 0;
+
+        planner.count = 0;
+        planner.skipped = 0;
+        plan_directory(ctx, &planner, ctx->extended ? ctx->extended->rootCluster : 0, 0);
+
+        for (uint32_t index = 0; index < planner.count; index++) {
+            uint32_t target = move_chain(ctx, plan + index, buffer, bufferSize);
+
+            // Marks the ones that stay where they are
+            plan[index].target = target;
+            done+= target != 0;
+        }
+
+        // Nothing moved, so what's planned or skipped stays fragmented
+        if (done == 0) {
+            *fragmented = planner.count + planner.skipped;
+            return FAT_SUCCESS;
+        }
+
+        // The new chains are on the device before any entry points to them
+        if (fat_flush_table(ctx) != FAT_SUCCESS)
+            return FAT_ERROR;
+
+        for (uint32_t index = 0; index < planner.count; index++) {
+            struct FATDefragMove *move = plan + index;
+
+            if (move->target == 0)
+                continue;
+
+            if (ctx->device->read(ctx->device, move->sector, 1, ctx->buffer) != 1)
+                return FAT_ERROR;
+
+            struct FATDirectoryEntry *entry = ((struct FATDirectoryEntry*)ctx->buffer) + move->offset;
+            entry->firstClusterLowWord = move->target & 0xFFFF;
+            entry->firstClusterHighWord = move->target >> 16;
+
+            if (ctx->device->write(ctx->device, move->sector, 1, ctx->buffer) != 1)
+                return FAT_ERROR;
+
+            fat_invalidate_directory(ctx, move->directory);
+
+            // Only now the old chain can go
+            uint32_t cluster = move->cluster;
+            for (uint32_t count = 0; count < move->length && !fat_is_eoc(ctx, cluster); count++) {
+                uint32_t next = fat_next_cluster(ctx, cluster);
+
+                if (fat_set_next_cluster(ctx, cluster, 0) != FAT_SUCCESS)
+                    return FAT_ERROR;
+
+                cluster = next;
+            }
+
+            (*moved)++;
+        }
+
+        if (fat_flush_table(ctx) != FAT_SUCCESS)
+            return FAT_ERROR;
+    }
+}
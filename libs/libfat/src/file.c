@@ -0,0 +1,619 @@
+#include <fs/fat.h>
+#include <memory.h>
+
+// Trimmed down to the size of an entry this is a EOC mark on every type
+#define END_OF_CHAIN    0x0FFFFFFF
+
+#define ENTRY_DELETED   0xE5
+
+// Where a long name entry keeps the checksum of the short name it belongs to
+#define NAME_CHECKSUM   13
+
+/**
+ * Where a directory entry is stored on the device, with the long name entries
+ * in front of it
+ */
+struct EntryLocation {
+    uint32_t sector;
+    uint32_t offset;
+    uint32_t nameSector;
+    uint32_t nameOffset;
+    uint32_t names;
+};
+
+static inline uint32_t cluster_sector(struct FATContext *ctx, uint32_t cluster) {
+    return ctx->startOfData + (cluster - 2) * ctx->header->sectorsPerCluster;
+}
+
+static inline uint32_t root_cluster(struct FATContext *ctx) {
+    return ctx->extended ? ctx->extended->rootCluster : 0;
+}
+
+static inline uint32_t entry_cluster(struct FATDirectoryEntry *entry) {
+    return entry->firstClusterLowWord | (entry->firstClusterHighWord << 16);
+}
+
+static inline void set_entry_cluster(struct FATDirectoryEntry *entry, uint32_t cluster) {
+    entry->firstClusterLowWord = cluster & 0xFFFF;
+    entry->firstClusterHighWord = cluster >> 16;
+}
+
+static inline int is_long_name(const struct FATDirectoryEntry *entry) {
+    return (entry->attributes.value & FAT_ATTR_LONG_NAME) == FAT_ATTR_LONG_NAME;
+}
+
+static uint8_t name_checksum(const uint8_t *name) {
+    uint8_t sum = 0;
+
+    for (int i = 0; i < 11; i++)
+        sum = ((sum & 1) << 7) + (sum >> 1) + name[i];
+
+    return sum;
+}
+
+/**
+ * The sector of the directory that follows, 0 at the end of it
+ */
+static uint32_t next_sector(struct FATContext *ctx, uint32_t sector) {
+    // The root directory of FAT12 and FAT16 is one range of sectors
+    if (sector < ctx->startOfData)
+        return sector + 1 < ctx->startOfData ? sector + 1 : 0;
+
+    uint32_t relative = sector - ctx->startOfData;
+    if ((relative + 1) % ctx->header->sectorsPerCluster)
+        return sector + 1;
+
+    uint32_t cluster = fat_next_cluster(ctx, relative / ctx->header->sectorsPerCluster + 2);
+    if (fat_is_eoc(ctx, cluster))
+        return 0;
+
+    return cluster_sector(ctx, cluster);
+}
+
+/**
+ * Sets the modified date and time, and the day it was accessed
+ */
+static void touch(struct FATContext *ctx, struct FATDirectoryEntry *entry) {
+    if (ctx->clock == 0)
+        return;
+
+    ctx->clock(&entry->modified.date, &entry->modified.time);
+    entry->lastAccessed = entry->modified.date;
+}
+
+/**
+ * Searches a directory for the name and remembers the first slot that can be
+ * used for a new entry, and the last cluster of the directory
+ */
+static int search_directory(struct FATContext *ctx, uint32_t directory, const uint8_t *name, struct FATDirectoryEntry *entry, struct EntryLocation *found, struct EntryLocation *empty, uint32_t *last) {
+    uint32_t entriesPerSector = ctx->header->bytesPerSector / 32;
+    uint32_t cluster = directory;
+
+    // The long name entries seen since the last short entry
+    struct EntryLocation names = { 0 };
+    uint8_t checksum = 0;
+
+    empty->sector = 0;
+    empty->names = 0;
+    *last = directory;
+
+    for (;;) {
+        uint32_t first, count;
+
+        if (cluster == 0) {
+            first = ctx->startOfRootDirectory;
+            count = ctx->startOfData - ctx->startOfRootDirectory;
+        } else {
+            first = cluster_sector(ctx, cluster);
+            count = ctx->header->sectorsPerCluster;
+        }
+
+        for (uint32_t sector = first; sector < first + count; sector++) {
+            if (ctx->device->read(ctx->device, sector, 1, ctx->buffer) != 1)
+                return FAT_ERROR;
+
+            struct FATDirectoryEntry *cursor = ctx->buffer;
+            for (uint32_t offset = 0; offset < entriesPerSector; offset++, cursor++) {
+                if (cursor->name[0] == 0 || cursor->name[0] == ENTRY_DELETED) {
+                    names.names = 0;
+
+                    if (empty->sector == 0) {
+                        empty->sector = sector;
+                        empty->offset = offset;
+                    }
+
+                    // Nothing follows the end marker
+                    if (cursor->name[0] == 0)
+                        return 0;
+
+                    continue;
+                }
+
+                if (is_long_name(cursor)) {
+                    uint8_t current = ((uint8_t*)cursor)[NAME_CHECKSUM];
+
+                    // All of them belong to the same short entry
+                    if (names.names == 0 || current != checksum) {
+                        names.nameSector = sector;
+                        names.nameOffset = offset;
+                        names.names = 0;
+                        checksum = current;
+                    }
+
+                    names.names++;
+                    continue;
+                }
+
+                if (memory_compare(cursor->name, name, 11) == 0) {
+                    memory_copy(entry, cursor, sizeof(struct FATDirectoryEntry));
+                    found->sector = sector;
+                    found->offset = offset;
+                    found->nameSector = names.nameSector;
+                    found->nameOffset = names.nameOffset;
+                    found->names = names.names && checksum == name_checksum(cursor->name) ? names.names : 0;
+                    return 1;
+                }
+
+                names.names = 0;
+            }
+        }
+
+        if (cluster == 0)
+            return 0;
+
+        *last = cluster;
+        cluster = fat_next_cluster(ctx, cluster);
+        if (fat_is_eoc(ctx, cluster))
+            return 0;
+    }
+}
+
+/**
+ * Walks the path to the directory holding its last segment
+ */
+static int find_parent(struct FATContext *ctx, const char *path, uint32_t *directory, uint8_t *name) {
+    struct FATDirectoryEntry entry;
+    struct EntryLocation found, empty;
+    uint32_t last;
+
+    *directory = root_cluster(ctx);
+
+    for (;;) {
+        while (*path == '/' || *path == '\\')
+            path++;
+
+        if (*path == '\0' || (path = fat_parse_segment(path, name)) == 0)
+            return FAT_ERROR;
+
+        if (*path == '\0')
+            return FAT_SUCCESS;
+
+        if (search_directory(ctx, *directory, name, &entry, &found, &empty, &last) != 1)
+            return FAT_ERROR;
+
+        if (!entry.attributes.directory)
+            return FAT_ERROR;
+
+        // A ".." pointing to the root uses 0
+        if ((*directory = entry_cluster(&entry)) == 0)
+            *directory = root_cluster(ctx);
+    }
+}
+
+static int write_entry(struct FATContext *ctx, struct EntryLocation *location, struct FATDirectoryEntry *entry) {
+    if (ctx->device->read(ctx->device, location->sector, 1, ctx->buffer) != 1)
+        return FAT_ERROR;
+
+    memory_copy(((struct FATDirectoryEntry*)ctx->buffer) + location->offset, entry, sizeof(struct FATDirectoryEntry));
+
+    if (ctx->device->write(ctx->device, location->sector, 1, ctx->buffer) != 1)
+        return FAT_ERROR;
+
+    return FAT_SUCCESS;
+}
+
+static inline int is_free(struct FATContext *ctx, uint32_t cluster) {
+    if (ctx->freeMap)
+        return (ctx->freeMap[cluster / 32] >> (cluster & 31)) & 1;
+
+    return fat_next_cluster(ctx, cluster) == 0;
+}
+
+/**
+ * Whether the count clusters from cluster on are all free, tested on the free
+ * map a word at a time
+ */
+static inline int is_free_run(struct FATContext *ctx, uint32_t cluster, uint32_t count) {
+    uint32_t limit = cluster + count;
+
+    if (limit > ctx->numberOfClusters + 2)
+        return 0;
+
+    while (cluster < limit) {
+        uint32_t used = ~ctx->freeMap[cluster / 32] >> (cluster & 31);
+
+        if (used)
+            return cluster + __builtin_ctz(used) >= limit;
+
+        cluster = (cluster | 31) + 1;
+    }
+
+    return 1;
+}
+
+/**
+ * Picks where the next count clusters of a file go. Carrying on right after
+ * the previous cluster adds no fragment, otherwise the smallest run that
+ * fits is taken, or the largest run when none does so a file ends up in as
+ * few pieces as possible. Without a free map it's one cluster at a time.
+ */
+static uint32_t find_run(struct FATContext *ctx, uint32_t previous, uint32_t count, uint32_t *length) {
+    uint32_t end = ctx->numberOfClusters + 2;
+    uint32_t start = ctx->nextFree;
+
+    if (start < 2 || start >= end)
+        start = 2;
+
+    if (ctx->freeMap) {
+        if (previous && is_free_run(ctx, previous + 1, count)) {
+            *length = count;
+            return previous + 1;
+        }
+
+        uint32_t cluster = fat_find_best_run(ctx, start, count, length);
+        if (*length > count)
+            *length = count;
+
+        return cluster;
+    }
+
+    *length = 1;
+    if (previous && previous + 1 < end && is_free(ctx, previous + 1))
+        return previous + 1;
+
+    for (uint32_t visited = 0, index = start; visited < ctx->numberOfClusters; visited++) {
+        if (is_free(ctx, index))
+            return index;
+
+        if (++index == end)
+            index = 2;
+    }
+
+    return 0;
+}
+
+/**
+ * Takes up to count free clusters that follow each other and links them
+ * after previous when given, the last one ends the chain. Returns the first
+ * cluster and the number taken, 0 when the volume is full.
+ */
+static uint32_t allocate_run(struct FATContext *ctx, uint32_t previous, uint32_t count, uint32_t *length) {
+    uint32_t cluster = find_run(ctx, previous, count, length);
+
+    if (cluster == 0)
+        return 0;
+
+    for (uint32_t index = cluster; index < cluster + *length; index++) {
+        uint32_t next = index + 1 < cluster + *length ? index + 1 : END_OF_CHAIN;
+
+        if (fat_set_next_cluster(ctx, index, next) != FAT_SUCCESS)
+            return 0;
+    }
+
+    if (previous && fat_set_next_cluster(ctx, previous, cluster) != FAT_SUCCESS)
+        return 0;
+
+    uint32_t end = ctx->numberOfClusters + 2;
+    ctx->nextFree = cluster + *length < end ? cluster + *length : 2;
+    return cluster;
+}
+
+/**
+ * Keeps the clusters needed for size bytes and frees the rest of the chain
+ */
+static int trim_chain(struct FATContext *ctx, struct FATDirectoryEntry *entry, uint32_t size, uint32_t *last) {
+    size_t clusterSize = ctx->header->sectorsPerCluster * ctx->header->bytesPerSector;
+    uint32_t keep = (size + clusterSize - 1) / clusterSize;
+    uint32_t cluster = entry_cluster(entry);
+    uint32_t previous = 0;
+
+    // The count guards against a chain that loops
+    for (uint32_t count = 0; count < keep && !fat_is_eoc(ctx, cluster); count++) {
+        previous = cluster;
+        cluster = fat_next_cluster(ctx, cluster);
+    }
+
+    if (previous) {
+        if (fat_set_next_cluster(ctx, previous, END_OF_CHAIN) != FAT_SUCCESS)
+            return FAT_ERROR;
+    } else {
+        set_entry_cluster(entry, 0);
+    }
+
+    for (uint32_t count = 0; count < ctx->numberOfClusters && !fat_is_eoc(ctx, cluster); count++) {
+        uint32_t next = fat_next_cluster(ctx, cluster);
+
+        if (fat_set_next_cluster(ctx, cluster, 0) != FAT_SUCCESS)
+            return FAT_ERROR;
+
+        cluster = next;
+    }
+
+    *last = previous;
+    return FAT_SUCCESS;
+}
+
+/**
+ * Writes size bytes after the end of the file, zeros when there is no data
+ */
+static int append(struct FATContext *ctx, struct FATDirectoryEntry *entry, const void *data, size_t size) {
+    uint32_t sectorsPerCluster = ctx->header->sectorsPerCluster;
+    size_t clusterSize = sectorsPerCluster * ctx->header->bytesPerSector;
+    uint32_t last;
+
+    // The chain must end at the cluster holding the last byte
+    if (trim_chain(ctx, entry, entry->fileSize, &last) != FAT_SUCCESS)
+        return FAT_ERROR;
+
+    size_t written = 0;
+    uint32_t offset = entry->fileSize % clusterSize;
+
+    // Fill up what is left of the last cluster
+    if (offset && size) {
+        size_t bytes = clusterSize - offset < size ? clusterSize - offset : size;
+
+        if (ctx->device->read(ctx->device, cluster_sector(ctx, last), sectorsPerCluster, ctx->buffer) != sectorsPerCluster)
+            return FAT_ERROR;
+
+        if (data) {
+            memory_copy(ctx->buffer + offset, data, bytes);
+        } else {
+            memory_set(ctx->buffer + offset, 0, bytes);
+        }
+
+        if (ctx->device->write(ctx->device, cluster_sector(ctx, last), sectorsPerCluster, ctx->buffer) != sectorsPerCluster)
+            return FAT_ERROR;
+
+        written+= bytes;
+    }
+
+    // The clusters that are still needed are known, so they're taken as runs
+    uint32_t needed = (size - written + clusterSize - 1) / clusterSize;
+
+    while (needed) {
+        uint32_t length;
+        uint32_t cluster = allocate_run(ctx, last, needed, &length);
+        if (cluster == 0)
+            break;
+
+        if (last == 0)
+            set_entry_cluster(entry, cluster);
+
+        last = cluster + length - 1;
+        needed-= length;
+
+        // Whole clusters go straight from the data, the rest through the buffer
+        const void *source = data + written;
+        uint32_t whole = (size - written) / clusterSize;
+        if (whole > length)
+            whole = length;
+
+        if (data == 0 || (ctx->device->alignment > 1 && ((size_t)source % ctx->device->alignment) != 0))
+            whole = 0;
+
+        if (whole) {
+            uint32_t count = whole * sectorsPerCluster;
+            if (ctx->device->write(ctx->device, cluster_sector(ctx, cluster), count, source) != count)
+                break;
+
+            written+= whole * clusterSize;
+        }
+
+        uint32_t index;
+        for (index = cluster + whole; index <= last; index++) {
+            size_t bytes = size - written < clusterSize ? size - written : clusterSize;
+
+            memory_set(ctx->buffer, 0, clusterSize);
+            if (data)
+                memory_copy(ctx->buffer, data + written, bytes);
+
+            if (ctx->device->write(ctx->device, cluster_sector(ctx, index), sectorsPerCluster, ctx->buffer) != sectorsPerCluster)
+                break;
+
+            written+= bytes;
+        }
+
+        if (index <= last)
+            break;
+    }
+
+    entry->fileSize+= written;
+    return written == size ? FAT_SUCCESS : FAT_ERROR;
+}
+
+/**
+ * Adds an entry to the directory in the empty slot, when there is none the
+ * directory is extended with a cluster
+ */
+static int create_entry(struct FATContext *ctx, uint32_t directory, const uint8_t *name, struct EntryLocation *empty, uint32_t last, struct FATDirectoryEntry *entry) {
+    // Names like . and .. are reserved
+    if (name[0] == '.' || name[0] == ' ')
+        return FAT_ERROR;
+
+    if (empty->sector == 0) {
+        // The root directory of FAT12 and FAT16 can't grow
+        if (directory == 0)
+            return FAT_ERROR;
+
+        uint32_t length;
+        uint32_t cluster = allocate_run(ctx, last, 1, &length);
+        if (cluster == 0)
+            return FAT_ERROR;
+
+        size_t clusterSize = ctx->header->sectorsPerCluster * ctx->header->bytesPerSector;
+        memory_set(ctx->buffer, 0, clusterSize);
+
+        uint32_t count = ctx->header->sectorsPerCluster;
+        if (ctx->device->write(ctx->device, cluster_sector(ctx, cluster), count, ctx->buffer) != count)
+            return FAT_ERROR;
+
+        empty->sector = cluster_sector(ctx, cluster);
+        empty->offset = 0;
+    }
+
+    memory_set(entry, 0, sizeof(struct FATDirectoryEntry));
+    memory_copy(entry->name, name, 11);
+    entry->attributes.value = FAT_ATTR_ARCHIVE;
+
+    touch(ctx, entry);
+    entry->created.time = entry->modified.time;
+    entry->created.date = entry->modified.date;
+
+    return write_entry(ctx, empty, entry);
+}
+
+/**
+ * Finds the file of the path, or creates it when asked to
+ */
+static int open_entry(struct FATContext *ctx, const char *path, int create, struct FATDirectoryEntry *entry, struct EntryLocation *location, uint32_t *directory) {
+    struct EntryLocation empty;
+    uint8_t name[11];
+    uint32_t last;
+
+    if (find_parent(ctx, path, directory, name) != FAT_SUCCESS)
+        return FAT_ERROR;
+
+    switch (search_directory(ctx, *directory, name, entry, location, &empty, &last)) {
+        case 1:
+            if (entry->attributes.directory || entry->attributes.volumeId)
+                return FAT_ERROR;
+
+            return FAT_SUCCESS;
+        case 0:
+            if (!create)
+                return FAT_ERROR;
+
+            if (create_entry(ctx, *directory, name, &empty, last, entry) != FAT_SUCCESS)
+                return FAT_ERROR;
+
+            memory_copy(location, &empty, sizeof(struct EntryLocation));
+            fat_invalidate_directory(ctx, *directory);
+            return FAT_SUCCESS;
+    }
+
+    return FAT_ERROR;
+}
+
+/**
+ * Stores the changed entry and writes the table
+ */
+static int close_entry(struct FATContext *ctx, struct EntryLocation *location, struct FATDirectoryEntry *entry, uint32_t directory, int resultCode) {
+    fat_invalidate_directory(ctx, directory);
+    touch(ctx, entry);
+
+    if (write_entry(ctx, location, entry) != FAT_SUCCESS)
+        return FAT_ERROR;
+
+    if (fat_flush_table(ctx) != FAT_SUCCESS)
+        return FAT_ERROR;
+
+    return resultCode;
+}
+
+/**
+ * Marks the long name entries in front of the entry as deleted, they may
+ * start in an earlier sector or cluster of the directory
+ */
+static int delete_names(struct FATContext *ctx, struct EntryLocation *location) {
+    uint32_t entriesPerSector = ctx->header->bytesPerSector / 32;
+    uint32_t sector = location->nameSector;
+    uint32_t offset = location->nameOffset;
+    uint32_t count = location->names;
+
+    while (count > 0) {
+        if (sector == 0 || ctx->device->read(ctx->device, sector, 1, ctx->buffer) != 1)
+            return FAT_ERROR;
+
+        struct FATDirectoryEntry *entries = ctx->buffer;
+        for (; offset < entriesPerSector && count > 0; offset++, count--)
+            entries[offset].name[0] = ENTRY_DELETED;
+
+        if (ctx->device->write(ctx->device, sector, 1, ctx->buffer) != 1)
+            return FAT_ERROR;
+
+        sector = next_sector(ctx, sector);
+        offset = 0;
+    }
+
+    return FAT_SUCCESS;
+}
+
+void fat_set_clock(struct FATContext *ctx, void (*clock)(struct FATDate *date, struct FATTime *time)) {
+    ctx->clock = clock;
+}
+
+int fat_store_file(struct FATContext *ctx, const char *path, const void *data, size_t size) {
+    struct FATDirectoryEntry entry;
+    struct EntryLocation location;
+    uint32_t directory, last;
+
+    if (open_entry(ctx, path, 1, &entry, &location, &directory) != FAT_SUCCESS)
+        return FAT_ERROR;
+
+    int resultCode = trim_chain(ctx, &entry, 0, &last);
+    entry.fileSize = 0;
+
+    if (resultCode == FAT_SUCCESS)
+        resultCode = append(ctx, &entry, data, size);
+
+    return close_entry(ctx, &location, &entry, directory, resultCode);
+}
+
+int fat_append_file(struct FATContext *ctx, const char *path, const void *data, size_t size) {
+    struct FATDirectoryEntry entry;
+    struct EntryLocation location;
+    uint32_t directory;
+
+    if (open_entry(ctx, path, 1, &entry, &location, &directory) != FAT_SUCCESS)
+        return FAT_ERROR;
+
+    int resultCode = append(ctx, &entry, data, size);
+
+    return close_entry(ctx, &location, &entry, directory, resultCode);
+}
+
+int fat_truncate_file(struct FATContext *ctx, const char *path, size_t size) {
+    struct FATDirectoryEntry entry;
+    struct EntryLocation location;
+    uint32_t directory, last;
+    int resultCode;
+
+    if (open_entry(ctx, path, 0, &entry, &location, &directory) != FAT_SUCCESS)
+        return FAT_ERROR;
+
+    if (size <= entry.fileSize) {
+        resultCode = trim_chain(ctx, &entry, size, &last);
+        entry.fileSize = size;
+    } else {
+        resultCode = append(ctx, &entry, 0, size - entry.fileSize);
+    }
+
+    return close_entry(ctx, &location, &entry, directory, resultCode);
+}
+
+int fat_remove_file(struct FATContext *ctx, const char *path) {
+    struct FATDirectoryEntry entry;
+    struct EntryLocation location;
+    uint32_t directory, last;
+
+    if (open_entry(ctx, path, 0, &entry, &location, &directory) != FAT_SUCCESS)
+        return FAT_ERROR;
+
+    int resultCode = trim_chain(ctx, &entry, 0, &last);
+    entry.name[0] = ENTRY_DELETED;
+
+    if (resultCode == FAT_SUCCESS)
+        resultCode = delete_names(ctx, &location);
+
+    return close_entry(ctx, &location, &entry, directory, resultCode);
+}
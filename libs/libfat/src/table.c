@@ -0,0 +1,288 @@
+#include <fs/fat.h>
+#include <memory.h>
+
+/**
+ * Packs 16 bit entries back into 12 bit ones, 8 at a time into 3 words
+ */
+static void pack_fat12(const uint16_t *source, uint8_t *destination, uint32_t count) {
+    uint32_t index = 0;
+
+    for (; index + 8 <= count; index+= 8, destination+= 12) {
+        const uint16_t *e = source + index;
+        uint32_t *words = (uint32_t*)destination;
+
+        // The entries are widened first, shifting into the top bit of an int overflows
+        words[0] = (uint32_t)e[0] | ((uint32_t)e[1] << 12) | ((uint32_t)e[2] << 24);
+        words[1] = ((uint32_t)e[2] >> 8) | ((uint32_t)e[3] << 4) | ((uint32_t)e[4] << 16) | ((uint32_t)e[5] << 28);
+        words[2] = ((uint32_t)e[5] >> 4) | ((uint32_t)e[6] << 8) | ((uint32_t)e[7] << 20);
+    }
+
+    // The remaining ones the slow way, so bytes after the last entry stay untouched
+    for (; index < count; index++) {
+        uint8_t *ptr = destination + (index & 7) + (index & 7) / 2;
+        uint16_t value = source[index];
+
+        if (index & 1) {
+            ptr[0] = (ptr[0] & 0x0F) | ((value & 0xF) << 4);
+            ptr[1] = value >> 4;
+        } else {
+            ptr[0] = value;
+            ptr[1] = (ptr[1] & 0xF0) | ((value >> 8) & 0xF);
+        }
+    }
+}
+
+/**
+ * Byte offset of the entry in the table and the number of bytes it spans
+ */
+static inline uint32_t entry_offset(struct FATContext *ctx, uint32_t index, uint32_t *size) {
+    switch (ctx->type) {
+        case FAT12: *size = 2; return index + index / 2;
+        case FAT16: *size = 2; return index * 2;
+        default: *size = 4; return index * 4;
+    }
+}
+
+/**
+ * Marks the page holding the data as changed
+ */
+static void mark_page(struct FATContext *ctx, void *data) {
+    for (uint32_t index = 0; index < ctx->numberOfPages; index++) {
+        if (ctx->pages[index].data == data) {
+            ctx->pages[index].dirty = 1;
+            return;
+        }
+    }
+}
+
+/**
+ * Updates an entry of a table that is paged, the changed pages are written
+ * when they're reused or flushed
+ */
+static int set_paged(struct FATContext *ctx, uint32_t index, uint32_t next) {
+    uint32_t bytesPerSector = ctx->header->bytesPerSector;
+    uint32_t size;
+    uint32_t offset = entry_offset(ctx, index, &size);
+
+    uint32_t sector = offset / bytesPerSector;
+    offset%= bytesPerSector;
+
+    uint8_t *first = fat_table_sector(ctx, sector);
+    uint8_t *second = first;
+    if (first == 0)
+        return FAT_ERROR;
+
+    // Only a FAT12 entry can straddle two sectors, both must stay loaded
+    if (offset + size > bytesPerSector) {
+        second = fat_table_sector(ctx, sector + 1);
+        if (second == 0 || second == first)
+            return FAT_ERROR;
+    }
+
+    uint8_t *bytes[4];
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        bytes[i] = offset + i < bytesPerSector ? first + offset + i : second + offset + i - bytesPerSector;
+        value|= *bytes[i] << (i * 8);
+    }
+
+    switch (ctx->type) {
+        case FAT12:
+            if (index & 1) {
+                value = (value & 0x000F) | ((next & 0xFFF) << 4);
+            } else {
+                value = (value & 0xF000) | (next & 0xFFF);
+            }
+        break;
+        case FAT16:
+            value = next & 0xFFFF;
+        break;
+        default:
+            value = (value & ~FAT32_MASK) | (next & FAT32_MASK);
+        break;
+    }
+
+    for (uint32_t i = 0; i < size; i++)
+        *bytes[i] = value >> (i * 8);
+
+    mark_page(ctx, first);
+    if (second != first)
+        mark_page(ctx, second);
+
+    return FAT_SUCCESS;
+}
+
+/**
+ * Writes sectors of the table to the same place in every copy
+ */
+static int write_copies(struct FATContext *ctx, uint32_t sector, uint32_t count, const void *data) {
+    for (uint32_t copy = 0; copy < ctx->header->numberOfFatCopies; copy++) {
+        uint32_t sectorIndex = ctx->header->reservedSectors + copy * ctx->sectorsPerFat + sector;
+
+        if (ctx->device->write(ctx->device, sectorIndex, count, data) != count)
+            return FAT_ERROR;
+    }
+
+    return FAT_SUCCESS;
+}
+
+/**
+ * Write the free space hints back to the FSInfo sector and its backup
+ */
+static int write_info(struct FATContext *ctx) {
+    uint16_t infoSector = ctx->extended->fileSystemInfoSector;
+    uint16_t backupSector = ctx->extended->backupBootSector;
+
+    if (infoSector == 0 || infoSector == 0xFFFF || infoSector >= ctx->header->reservedSectors)
+        return FAT_SUCCESS;
+
+    if (ctx->device->read(ctx->device, infoSector, 1, ctx->buffer) != 1)
+        return FAT_ERROR;
+
+    struct FATFileSystemInfo *info = ctx->buffer;
+    if (info->leadSignature != FAT_FSINFO_LEAD_SIGNATURE || info->structureSignature != FAT_FSINFO_STRUCTURE_SIGNATURE)
+        return FAT_SUCCESS;
+
+    info->freeClusters = ctx->freeClusters;
+    info->nextFree = ctx->nextFree;
+
+    if (ctx->device->write(ctx->device, infoSector, 1, info) != 1)
+        return FAT_ERROR;
+
+    // The backup of the FSInfo follows the backup of the boot sector
+    if (backupSector != 0 && backupSector + infoSector < ctx->header->reservedSectors) {
+        if (ctx->device->write(ctx->device, backupSector + infoSector, 1, info) != 1)
+            return FAT_ERROR;
+    }
+
+    return FAT_SUCCESS;
+}
+
+int fat_set_next_cluster(struct FATContext *ctx, uint32_t index, uint32_t next) {
+    if (ctx->freeClusters != FAT_FSINFO_UNKNOWN) {
+        uint32_t previous = fat_next_cluster(ctx, index);
+
+        if (previous == 0 && next != 0) {
+            ctx->freeClusters--;
+        } else if (previous != 0 && next == 0) {
+            ctx->freeClusters++;
+        }
+    }
+
+    if (ctx->freeMap) {
+        if (next == 0) {
+            ctx->freeMap[index / 32]|= 1u << (index & 31);
+        } else {
+            ctx->freeMap[index / 32]&= ~(1u << (index & 31));
+        }
+    }
+
+    if (ctx->fat == 0)
+        return ctx->pages ? set_paged(ctx, index, next) : FAT_ERROR;
+
+    uint32_t size;
+    uint32_t offset = entry_offset(ctx, index, &size);
+    uint32_t first = offset / ctx->header->bytesPerSector;
+    uint32_t last = (offset + size - 1) / ctx->header->bytesPerSector;
+    fat_mark_table_dirty(ctx, first, last - first + 1);
+
+    // The expanded table is only packed again when flushed
+    if (ctx->expanded) {
+        ctx->expanded[index] = next & 0xFFF;
+        return FAT_SUCCESS;
+    }
+
+    switch (ctx->type) {
+        case FAT12:
+            uint16_t *ptr = ctx->fat + (index + index / 2);
+
+            if (index & 1) {
+                *ptr = (*ptr & 0x000F) | ((next & 0xFFF) << 4);
+            } else {
+                *ptr = (*ptr & 0xF000) | (next & 0xFFF);
+            }
+        break;
+        case FAT16:
+            ((uint16_t*)ctx->fat)[index] = next;
+        break;
+        case FAT32:
+            // Keep the reserved top 4 bits as they are
+            ((uint32_t*)ctx->fat)[index] = (((uint32_t*)ctx->fat)[index] & ~FAT32_MASK) | (next & FAT32_MASK);
+        break;
+    }
+
+    return FAT_SUCCESS;
+}
+
+void fat_mark_table_dirty(struct FATContext *ctx, uint32_t sector, uint32_t count) {
+    if (ctx->fat == 0) {
+        for (uint32_t index = sector; index < sector + count; index++)
+            mark_page(ctx, fat_table_sector(ctx, index));
+
+        return;
+    }
+
+    for (uint32_t index = sector; index < sector + count && index < ctx->sectorsPerFat; index++)
+        ctx->dirty[index / 32]|= 1u << (index & 31);
+}
+
+int fat_flush_table(struct FATContext *ctx) {
+    uint32_t changed = 0;
+
+    if (ctx->fat == 0) {
+        if (ctx->pages == 0)
+            return FAT_ERROR;
+
+        for (uint32_t index = 0; index < ctx->numberOfPages; index++) {
+            struct FATTablePage *page = ctx->pages + index;
+
+            if (!page->dirty)
+                continue;
+
+            if (write_copies(ctx, page->sector, 1, page->data) != FAT_SUCCESS)
+                return FAT_ERROR;
+
+            page->dirty = 0;
+            changed++;
+        }
+    } else {
+        if (ctx->expanded)
+            pack_fat12(ctx->expanded, ctx->fat, ctx->numberOfClusters + 2);
+
+        // Sectors that changed and follow each other are written as one run
+        uint32_t sector = 0;
+        while (sector < ctx->sectorsPerFat) {
+            uint32_t word = ctx->dirty[sector / 32] >> (sector & 31);
+
+            if (word == 0) {
+                sector = (sector | 31) + 1;
+                continue;
+            }
+
+            sector+= __builtin_ctz(word);
+
+            uint32_t end = sector;
+            while (end < ctx->sectorsPerFat && (ctx->dirty[end / 32] & (1u << (end & 31)))) {
+                ctx->dirty[end / 32]&= ~(1u << (end & 31));
+                end++;
+            }
+
+            void *data = ctx->fat + sector * ctx->header->bytesPerSector;
+            if (write_copies(ctx, sector, end - sector, data) != FAT_SUCCESS)
+                return FAT_ERROR;
+
+            changed++;
+            sector = end;
+        }
+    }
+
+    // Nothing changed means the free space hints didn't either
+    if (changed && ctx->extended && write_info(ctx) != FAT_SUCCESS)
+        return FAT_ERROR;
+
+    // The metadata is consistent again, which a log device commits on
+    if (!ctx->device->action(ctx->device, BLOCK_DEVICE_FLUSH))
+        return FAT_ERROR;
+
+    return FAT_SUCCESS;
+}
@@ -0,0 +1,342 @@
+#define _GNU_SOURCE
+#include <driver/posix.h>
+#include <aio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Largest number of segments handed to a single preadv or pwritev
+#define FILE_DEVICE_IOVECS 64
+
+/**
+ * A submitted request while aio is working on it
+ */
+struct FileRequest {
+	struct aiocb control;
+	struct BlockRequest *request;
+	struct FileRequest *next;
+};
+
+struct FileBlockDevice {
+	struct BlockDevice device;
+	int handle;
+	pthread_mutex_t lock;
+	struct FileRequest *pending;
+};
+
+static int posix_file_device_wait(struct FileBlockDevice *fbd);
+
+/**
+ * Perform close, flush or wait
+ */
+static int posix_file_device_action(const struct BlockDevice *device, bdaction_t action){
+	struct FileBlockDevice *fbd = (void*)device;
+
+	if(fbd->handle < 0)
+		return 0;
+
+	switch (action) {
+		case BLOCK_DEVICE_CLOSE:
+			// Whatever is on its way still has to be completed
+			while (fbd->pending) {
+				if(!posix_file_device_wait(fbd))
+					return 0;
+			}
+			if(close(fbd->handle) != 0)
+				return 0;
+			pthread_mutex_destroy(&fbd->lock);
+			fbd->handle = -1;
+			return 1;
+		case BLOCK_DEVICE_FLUSH:
+			return fdatasync(fbd->handle) == 0;
+		case BLOCK_DEVICE_WAIT:
+			return posix_file_device_wait(fbd);
+		default:
+			break;
+	}
+
+	// Nothing to do for the other actions
+	return 1;
+}
+
+/**
+ * Transfers the bytes at the offset, going on after a short transfer until
+ * the end of the file is reached or it fails
+ */
+static size_t transfer(int handle, int write, void *address, size_t size, off_t offset) {
+	size_t done = 0;
+
+	while (done < size) {
+		ssize_t result = write
+			? pwrite(handle, address + done, size - done, offset + done)
+			: pread(handle, address + done, size - done, offset + done);
+
+		if(result <= 0)
+			break;
+
+		done+= result;
+	}
+
+	return done;
+}
+
+/**
+ * Read or write the given sectors. With O_DIRECT memory that isn't aligned
+ * goes through an aligned copy.
+ */
+static uint32_t posix_file_device_transfer(const struct BlockDevice *device, uint32_t index, uint32_t count, void *address, int write) {
+	struct FileBlockDevice *fbd = (void*)device;
+	size_t size = (size_t)count * device->blockSize;
+	off_t offset = (off_t)index * device->blockSize;
+
+	if(fbd->handle < 0)
+		return 0;
+
+	if(device->alignment > 1 && (size_t)address % device->alignment) {
+		void *aligned;
+		if(posix_memalign(&aligned, device->alignment, size) != 0)
+			return 0;
+
+		if(write)
+			memcpy(aligned, address, size);
+
+		size_t done = transfer(fbd->handle, write, aligned, size, offset);
+
+		if(!write)
+			memcpy(address, aligned, done);
+
+		free(aligned);
+		return done / device->blockSize;
+	}
+
+	return transfer(fbd->handle, write, address, size, offset) / device->blockSize;
+}
+
+static uint32_t posix_file_device_read(const struct BlockDevice *device, uint32_t index, uint32_t count, void *address) {
+	return posix_file_device_transfer(device, index, count, address, 0);
+}
+
+static uint32_t posix_file_device_write(const struct BlockDevice *device, uint32_t index, uint32_t count, const void *address) {
+	return posix_file_device_transfer(device, index, count, (void*)address, 1);
+}
+
+/**
+ * Segments that follow each other on the device go with a single preadv or
+ * pwritev, the rest one by one
+ */
+static uint32_t posix_file_device_vector(const struct BlockDevice *device, const struct BlockSegment *segments, uint32_t count, int write) {
+	struct FileBlockDevice *fbd = (void*)device;
+	struct iovec vectors[FILE_DEVICE_IOVECS];
+	uint32_t total = 0;
+
+	if(fbd->handle < 0)
+		return 0;
+
+	for (uint32_t index = 0; index < count;) {
+		uint32_t sectors = 0;
+		uint32_t used = 0;
+		int aligned = 1;
+
+		while (index + used < count && used < FILE_DEVICE_IOVECS) {
+			const struct BlockSegment *segment = segments + index + used;
+
+			if(used && segment->index != segments[index].index + sectors)
+				break;
+
+			vectors[used].iov_base = segment->address;
+			vectors[used].iov_len = (size_t)segment->count * device->blockSize;
+			aligned&= device->alignment <= 1 || (size_t)segment->address % device->alignment == 0;
+			sectors+= segment->count;
+			used++;
+		}
+
+		// Unaligned memory has to go through the copy of a single transfer
+		if(!aligned || used == 1) {
+			uint32_t done = posix_file_device_transfer(device, segments[index].index, segments[index].count, segments[index].address, write);
+			total+= done;
+			if(done != segments[index].count)
+				break;
+
+			index++;
+			continue;
+		}
+
+		off_t offset = (off_t)segments[index].index * device->blockSize;
+		ssize_t result = write ? pwritev(fbd->handle, vectors, used, offset) : preadv(fbd->handle, vectors, used, offset);
+		uint32_t done = result > 0 ? result / device->blockSize : 0;
+
+		total+= done;
+		if(done != sectors)
+			break;
+
+		index+= used;
+	}
+
+	return total;
+}
+
+static uint32_t posix_file_device_readv(const struct BlockDevice *device, const struct BlockSegment *segments, uint32_t count) {
+	return posix_file_device_vector(device, segments, count, 0);
+}
+
+static uint32_t posix_file_device_writev(const struct BlockDevice *device, const struct BlockSegment *segments, uint32_t count) {
+	return posix_file_device_vector(device, segments, count, 1);
+}
+
+/**
+ * Starts the request with aio. Memory that doesn't suit O_DIRECT is
+ * transfered through a copy right away.
+ */
+static int posix_file_device_submit(const struct BlockDevice *device, struct BlockRequest *request) {
+	struct FileBlockDevice *fbd = (void*)device;
+
+	if(fbd->handle < 0)
+		return 0;
+
+	if(device->alignment > 1 && (size_t)request->address % device->alignment) {
+		request->done = posix_file_device_transfer(device, request->index, request->count, request->address, request->write);
+		if(request->complete)
+			request->complete(request);
+		return 1;
+	}
+
+	struct FileRequest *pending = calloc(1, sizeof(struct FileRequest));
+	if(pending == 0)
+		return 0;
+
+	pending->request							= request;
+	pending->control.aio_fildes					= fbd->handle;
+	pending->control.aio_offset					= (off_t)request->index * device->blockSize;
+	pending->control.aio_buf					= request->address;
+	pending->control.aio_nbytes					= (size_t)request->count * device->blockSize;
+	pending->control.aio_sigevent.sigev_notify	= SIGEV_NONE;
+
+	if((request->write ? aio_write(&pending->control) : aio_read(&pending->control)) != 0) {
+		free(pending);
+		return 0;
+	}
+
+	pthread_mutex_lock(&fbd->lock);
+	pending->next = fbd->pending;
+	fbd->pending = pending;
+	pthread_mutex_unlock(&fbd->lock);
+
+	return 1;
+}
+
+/**
+ * Waits for at least one submitted request and completes every one that is
+ * done. The callbacks run on the thread that waits.
+ */
+static int posix_file_device_wait(struct FileBlockDevice *fbd) {
+	const struct aiocb **list;
+	struct FileRequest *finished = 0;
+	int count = 0;
+
+	pthread_mutex_lock(&fbd->lock);
+	for (struct FileRequest *cursor = fbd->pending; cursor; cursor = cursor->next)
+		count++;
+
+	if(count == 0) {
+		pthread_mutex_unlock(&fbd->lock);
+		return 1;
+	}
+
+	list = malloc(count * sizeof(struct aiocb*));
+	if(list == 0) {
+		pthread_mutex_unlock(&fbd->lock);
+		return 0;
+	}
+
+	count = 0;
+	for (struct FileRequest *cursor = fbd->pending; cursor; cursor = cursor->next)
+		list[count++] = &cursor->control;
+	pthread_mutex_unlock(&fbd->lock);
+
+	// Requests submitted in the mean time aren't waited for, they're only
+	// completed when they happen to be done
+	while (aio_suspend(list, count, 0) != 0 && errno == EINTR);
+	free(list);
+
+	pthread_mutex_lock(&fbd->lock);
+	struct FileRequest **link = &fbd->pending;
+	while (*link) {
+		struct FileRequest *cursor = *link;
+		if(aio_error(&cursor->control) == EINPROGRESS) {
+			link = &cursor->next;
+			continue;
+		}
+
+		*link = cursor->next;
+		cursor->next = finished;
+		finished = cursor;
+	}
+	pthread_mutex_unlock(&fbd->lock);
+
+	while (finished) {
+		struct FileRequest *next = finished->next;
+		struct BlockRequest *request = finished->request;
+		ssize_t result = aio_return(&finished->control);
+
+		request->done = result > 0 ? result / fbd->device.blockSize : 0;
+		free(finished);
+
+		if(request->complete)
+			request->complete(request);
+
+		finished = next;
+	}
+
+	return 1;
+}
+
+size_t posix_file_device_size(){
+	return sizeof(struct FileBlockDevice);
+}
+
+int posix_get_file_device(struct BlockDevice *device, const char* filename, unsigned int blockSize, int direct) {
+	int flags = O_RDWR;
+	int alignment = 1;
+
+#ifdef O_DIRECT
+	if(direct) {
+		flags|= O_DIRECT;
+
+		// Memory and offsets have to line up with the pages
+		alignment = sysconf(_SC_PAGESIZE);
+		if(blockSize % 512 != 0)
+			return 0;
+	}
+#else
+	if(direct)
+		return 0;
+#endif
+
+	int handle = open(filename, flags);
+	if(handle < 0)
+		return 0;
+
+	struct FileBlockDevice *wrapper = (void*)device;
+	if(pthread_mutex_init(&wrapper->lock, 0) != 0) {
+		close(handle);
+		return 0;
+	}
+
+	wrapper->device.size		= sizeof(struct FileBlockDevice);
+	wrapper->device.blockSize 	= blockSize;
+	wrapper->device.alignment	= alignment;
+	wrapper->device.action		= posix_file_device_action;
+	wrapper->device.read		= posix_file_device_read;
+	wrapper->device.write		= posix_file_device_write;
+	wrapper->device.readv		= posix_file_device_readv;
+	wrapper->device.writev		= posix_file_device_writev;
+	wrapper->device.submit		= posix_file_device_submit;
+	wrapper->handle				= handle;
+	wrapper->pending			= 0;
+
+	return 1;
+}
@@ -0,0 +1,152 @@
+#include <driver/posix.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct MappedBlockDevice {
+	struct BlockDevice device;
+	int handle;
+	uint8_t *mapping;
+	size_t length;
+	uint32_t count;
+};
+
+/**
+ * Number of the sectors that are in the mapping
+ */
+static inline uint32_t clamp(struct MappedBlockDevice *mbd, uint32_t index, uint32_t count) {
+	if(index >= mbd->count)
+		return 0;
+
+	return count < mbd->count - index ? count : mbd->count - index;
+}
+
+/**
+ * Peform close or flush
+ */
+static int posix_mapped_device_action(const struct BlockDevice *device, bdaction_t action){
+	struct MappedBlockDevice *mbd = (void*)device;
+
+	if(mbd->mapping == 0)
+		return 0;
+
+	switch (action) {
+		case BLOCK_DEVICE_CLOSE:
+			if(msync(mbd->mapping, mbd->length, MS_SYNC) != 0)
+				return 0;
+			munmap(mbd->mapping, mbd->length);
+			close(mbd->handle);
+			mbd->mapping = 0;
+			return 1;
+		case BLOCK_DEVICE_FLUSH:
+			return msync(mbd->mapping, mbd->length, MS_SYNC) == 0;
+		default:
+			break;
+	}
+
+	// Nothing to do for the other actions
+	return 1;
+}
+
+/**
+ * Read the given sectors
+ */
+static uint32_t posix_mapped_device_read(const struct BlockDevice *device, uint32_t index, uint32_t count, void *address) {
+	struct MappedBlockDevice *mbd = (void*)device;
+
+	if(mbd->mapping == 0)
+		return 0;
+
+	count = clamp(mbd, index, count);
+	memcpy(address, mbd->mapping + (size_t)index * device->blockSize, (size_t)count * device->blockSize);
+	return count;
+}
+
+/**
+ * Write the given sectors, the image doesn't grow
+ */
+static uint32_t posix_mapped_device_write(const struct BlockDevice *device, uint32_t index, uint32_t count, const void *address) {
+	struct MappedBlockDevice *mbd = (void*)device;
+
+	if(mbd->mapping == 0)
+		return 0;
+
+	count = clamp(mbd, index, count);
+	memcpy(mbd->mapping + (size_t)index * device->blockSize, address, (size_t)count * device->blockSize);
+	return count;
+}
+
+/**
+ * Read the segments
+ */
+static uint32_t posix_mapped_device_readv(const struct BlockDevice *device, const struct BlockSegment *segments, uint32_t count) {
+	uint32_t total = 0;
+
+	for (uint32_t index = 0; index < count; index++) {
+		uint32_t read = posix_mapped_device_read(device, segments[index].index, segments[index].count, segments[index].address);
+		total+= read;
+		if(read != segments[index].count)
+			break;
+	}
+
+	return total;
+}
+
+/**
+ * Write the segments
+ */
+static uint32_t posix_mapped_device_writev(const struct BlockDevice *device, const struct BlockSegment *segments, uint32_t count) {
+	uint32_t total = 0;
+
+	for (uint32_t index = 0; index < count; index++) {
+		uint32_t written = posix_mapped_device_write(device, segments[index].index, segments[index].count, segments[index].address);
+		total+= written;
+		if(written != segments[index].count)
+			break;
+	}
+
+	return total;
+}
+
+size_t posix_mapped_device_size(){
+	return sizeof(struct MappedBlockDevice);
+}
+
+int posix_get_mapped_device(struct BlockDevice *device, const char* filename, unsigned int blockSize) {
+	int handle = open(filename, O_RDWR);
+	if(handle < 0)
+		return 0;
+
+	struct stat status;
+	if(fstat(handle, &status) != 0 || status.st_size < blockSize) {
+		close(handle);
+		return 0;
+	}
+
+	// A partial sector at the end can't be read, so it's left out
+	size_t length = status.st_size - status.st_size % blockSize;
+	void *mapping = mmap(0, length, PROT_READ | PROT_WRITE, MAP_SHARED, handle, 0);
+	if(mapping == MAP_FAILED) {
+		close(handle);
+		return 0;
+	}
+
+	struct MappedBlockDevice *wrapper = (void*)device;
+	wrapper->device.size		= sizeof(struct MappedBlockDevice);
+	wrapper->device.blockSize 	= blockSize;
+	wrapper->device.alignment	= 1;
+	wrapper->device.action		= posix_mapped_device_action;
+	wrapper->device.read		= posix_mapped_device_read;
+	wrapper->device.write		= posix_mapped_device_write;
+	wrapper->device.readv		= posix_mapped_device_readv;
+	wrapper->device.writev		= posix_mapped_device_writev;
+	wrapper->device.submit		= 0;
+	wrapper->handle				= handle;
+	wrapper->mapping			= mapping;
+	wrapper->length				= length;
+	wrapper->count				= length / blockSize;
+
+	return 1;
+}
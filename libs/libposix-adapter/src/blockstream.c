@@ -1,7 +1,13 @@
+// Offsets past 4 GiB on 32 bit systems as well
+#define _FILE_OFFSET_BITS 64
 #include <driver/posix.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+// Number of sectors of zeros written at once when an image is zeroed
+#define CREATE_CHUNK_SECTORS 2048
 
 struct StreamBlockDevice {
 	struct BlockDevice device;
@@ -25,9 +31,12 @@ static int posix_stream_device_action(const struct BlockDevice *device, bdaction
 			return 1;
 		case BLOCK_DEVICE_FLUSH:
 			return fflush(sbd->handle) == 0;
+		default:
+			break;
 	}
 
-    return 0;
+	// Nothing to do for the other actions
+	return 1;
 }
 
 /**
@@ -39,7 +48,7 @@ static uint32_t posix_stream_device_read(const struct BlockDevice *device, uint3
 	if(sbd->handle == 0)
 		return 0;
 
-	if(fseek(sbd->handle, index * device->blockSize, SEEK_SET) != 0)
+	if(fseeko(sbd->handle, (off_t)index * device->blockSize, SEEK_SET) != 0)
 		return 0;
 
 	return fread(address, device->blockSize, count, sbd->handle);
@@ -54,12 +63,66 @@ static uint32_t posix_stream_device_write(const struct BlockDevice *device, uint
 	if(sbd->handle == 0)
 		return 0;
 
-	if(fseek(sbd->handle, index * device->blockSize, SEEK_SET) != 0)
+	if(fseeko(sbd->handle, (off_t)index * device->blockSize, SEEK_SET) != 0)
 		return 0;
 
 	return fwrite(address, device->blockSize, count, sbd->handle);
 }
 
+/**
+ * Read the segments, only seeking when one doesn't start where the last
+ * one ended
+ */
+static uint32_t posix_stream_device_readv(const struct BlockDevice *device, const struct BlockSegment *segments, uint32_t count) {
+	struct StreamBlockDevice *sbd = (void*)device;
+	uint32_t total = 0;
+	uint32_t position = 0;
+
+	if(sbd->handle == 0)
+		return 0;
+
+	for (uint32_t index = 0; index < count; index++) {
+		if((index == 0 || segments[index].index != position) && fseeko(sbd->handle, (off_t)segments[index].index * device->blockSize, SEEK_SET) != 0)
+			break;
+
+		uint32_t read = fread(segments[index].address, device->blockSize, segments[index].count, sbd->handle);
+		total+= read;
+		if(read != segments[index].count)
+			break;
+
+		position = segments[index].index + read;
+	}
+
+	return total;
+}
+
+/**
+ * Write the segments, only seeking when one doesn't start where the last
+ * one ended
+ */
+static uint32_t posix_stream_device_writev(const struct BlockDevice *device, const struct BlockSegment *segments, uint32_t count) {
+	struct StreamBlockDevice *sbd = (void*)device;
+	uint32_t total = 0;
+	uint32_t position = 0;
+
+	if(sbd->handle == 0)
+		return 0;
+
+	for (uint32_t index = 0; index < count; index++) {
+		if((index == 0 || segments[index].index != position) && fseeko(sbd->handle, (off_t)segments[index].index * device->blockSize, SEEK_SET) != 0)
+			break;
+
+		uint32_t written = fwrite(segments[index].address, device->blockSize, segments[index].count, sbd->handle);
+		total+= written;
+		if(written != segments[index].count)
+			break;
+
+		position = segments[index].index + written;
+	}
+
+	return total;
+}
+
 size_t posix_stream_device_size(){
 	return sizeof(struct StreamBlockDevice);
 }
@@ -78,32 +141,57 @@ int posix_get_stream_device(struct BlockDevice *device, const char* filename, un
 	struct StreamBlockDevice *wrapper = (void*)device;
 	wrapper->device.size		= sizeof(struct StreamBlockDevice);
 	wrapper->device.blockSize 	= blockSize;
+	wrapper->device.alignment	= 1;
 	wrapper->device.action		= posix_stream_device_action;
 	wrapper->device.read		= posix_stream_device_read;
 	wrapper->device.write		= posix_stream_device_write;
+	wrapper->device.readv		= posix_stream_device_readv;
+	wrapper->device.writev		= posix_stream_device_writev;
+	wrapper->device.submit		= 0;
 	wrapper->handle				= handle;
 
 	return 1;
 }
 
-int posix_create_stream_device(struct BlockDevice *device, const char* filename, uint16_t blocksize, uint32_t count){
+int posix_create_stream_device(struct BlockDevice *device, const char* filename, uint16_t blocksize, uint32_t count, int zero){
 	FILE* handle = fopen(filename, "w+b");
 	if(!handle)
 		return 0;
 
-	void *emptySector = malloc(blocksize);
-	memset(emptySector, 0, blocksize);
+	off_t size = (off_t)blocksize * count;
 
-	for (uint32_t index = 0; index < count; index++) {
-		if (fwrite(emptySector, 1, blocksize, handle) != blocksize) {
-			free(emptySector);
+	// Setting the size leaves a hole that reads as zeros without using any
+	// space, only what's written later gets allocated
+	if(!zero) {
+		int result = ftruncate(fileno(handle), size);
+		fclose(handle);
+
+		if(result != 0)
+			return 0;
+
+		return posix_get_stream_device(device, filename, blocksize);
+	}
+
+	// Writing the zeros allocates every sector now, in large chunks
+	size_t chunk = (size_t)blocksize * CREATE_CHUNK_SECTORS;
+	void *empty = calloc(1, chunk);
+	if(!empty) {
+		fclose(handle);
+		return 0;
+	}
+
+	for (off_t offset = 0; offset < size; offset+= chunk) {
+		size_t bytes = size - offset < (off_t)chunk ? (size_t)(size - offset) : chunk;
+
+		if (fwrite(empty, 1, bytes, handle) != bytes) {
+			free(empty);
 			fclose(handle);
 			return 0;
 		}
 	}
 
-	free(emptySector);
+	free(empty);
 	fclose(handle);
 
 	return posix_get_stream_device(device, filename, blocksize);
-}
\ No newline at end of file
+}
@@ -5,6 +5,10 @@ static int interrupt_flag = 0;
 static int sense_interrupt = 0;
 static struct SenseResult lastSense;
 
+// A sector for memory that can't take a sector itself before the next 64K
+// boundary. Being aligned to its size it never crosses one.
+static uint8_t bounce[512] __attribute__ ((aligned (512)));
+
 /**
  * When a interrupt is triggers we set the interrupt_flag to high.
  * And if it was a command that requires a sense interrupt perform
@@ -134,17 +138,45 @@ void floppy_index_to_chs(uint32_t index, struct CHS *chs) {
 }
 
 /**
- * We are required to implement this
+ * Reads and writes go straight to the disk and nothing is submitted, so
+ * every action succeeds without doing anything
  */
-static int floppy_action(const struct BlockDevice*, bdaction_t action){
-    return 0;
+static int floppy_action(const struct BlockDevice*, bdaction_t){
+    return 1;
 }
 
-static inline uint32_t floppy_read_sectors(struct FloppyDevice *fd, uint32_t index, uint32_t count, void *address){
+static uint32_t floppy_read_sectors(struct FloppyDevice *fd, uint32_t index, uint32_t count, void *address){
     struct CHS chs;
     floppy_index_to_chs(index, &chs);
     floppy_seek(fd->drive, chs);
 
+    // A single command can't read past the end of the track. Clamp before
+    // setting up the DMA, otherwise a large request overflows its 16 bit count.
+    uint32_t canRead = FLPY_SECTORS_PER_TRACK - (chs.sector - 1);
+
+    if(count > canRead)
+        count = canRead;
+
+    // Neither can the DMA cross a 64K boundary of physical memory, the rest
+    // goes with the next command
+    uint32_t toBoundary = (0x10000 - ((uint32_t)address & 0xFFFF)) / 512;
+
+    // Not even one sector fits, so that one goes through the bounce sector
+    // instead of a transfer of nothing
+    if(toBoundary == 0) {
+        if(floppy_read_sectors(fd, index, 1, bounce) != 1)
+            return 0;
+
+        uint8_t *destination = address;
+        for(uint32_t offset = 0; offset < 512; offset++)
+            destination[offset] = bounce[offset];
+
+        return 1;
+    }
+
+    if(count > toBoundary)
+        count = toBoundary;
+
     // Setup the DMA to transfer bytes to the given address.
     // This -1 with the count is important, don't know if DMA keeps waiting,
     // but with the flag MULTI_TRACK qemu will read one more byte of the next
@@ -155,11 +187,6 @@ static inline uint32_t floppy_read_sectors(struct FloppyDevice *fd, uint32_t ind
     settings.count = count * 512 - 1;
     dma_setup(2, &settings);
 
-    uint32_t canRead = FLPY_SECTORS_PER_TRACK - (chs.sector - 1);
-
-    if(count > canRead)
-        count = canRead;
-
     uint8_t endSector = chs.sector + count;
 
     uint8_t cmd[10];
@@ -223,6 +250,34 @@ static uint32_t floppy_read(const struct BlockDevice *device, uint32_t index, ui
     return current - index;
 }
 
+/**
+ * Read the segments, the ones that follow each other on the disk and in
+ * memory go as one read so a track is read with a single command
+ */
+static uint32_t floppy_readv(const struct BlockDevice *device, const struct BlockSegment *segments, uint32_t count) {
+    uint32_t total = 0;
+
+    for (uint32_t index = 0; index < count;) {
+        uint32_t sectors = segments[index].count;
+        uint32_t next = index + 1;
+
+        while (next < count && segments[next].index == segments[index].index + sectors
+            && segments[next].address == segments[index].address + sectors * 512) {
+            sectors+= segments[next].count;
+            next++;
+        }
+
+        uint32_t read = floppy_read(device, segments[index].index, sectors, segments[index].address);
+        total+= read;
+        if (read != sectors)
+            break;
+
+        index = next;
+    }
+
+    return total;
+}
+
 /**
  * Write the given sectors
  */
@@ -245,9 +300,15 @@ int floppy_get_device(uint8_t index, struct BlockDevice *device){
 
     fd->device.size = sizeof(struct FloppyDevice);
     fd->device.blockSize = 512;
+    // A sector then never straddles a 64K boundary of the DMA, longer reads
+    // are split at the boundaries
+    fd->device.alignment = 512;
     fd->device.action = floppy_action;
     fd->device.read = floppy_read;
     fd->device.write = floppy_write;
+    fd->device.readv = floppy_readv;
+    fd->device.writev = 0;
+    fd->device.submit = 0;
     fd->drive = index;
     return 1;
 }
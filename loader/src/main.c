@@ -4,6 +4,7 @@
 #include "memory.h"
 #include "rtc.h"
 #include <driver/floppy.h>
+#include <io/cache.h>
 #include <fs/fat/readonly.h>
 
 #define unused __attribute__ ((unused))
@@ -38,6 +39,46 @@ static inline uint8_t inb(uint16_t port){
     return returnVal;
 }
 
+/**
+ * Loads a file from the filesystem into memory. The file is read through a
+ * stream in sector sized pieces, so the readahead gathers them into larger
+ * transfers from the floppy
+ *
+ * @param ctx       The filesystem
+ * @param path      Path of the file
+ * @param address   Where to load the file
+ * @return Number of bytes loaded, or -1 when the file couldn't be loaded
+ */
+static int32_t load_file(struct FATContext *ctx, const char *path, uint8_t *address) {
+    stream_t *stream = (void*)0x300000;
+    if (fat_open_file(ctx, stream, path) != FAT_SUCCESS)
+        return -1;
+
+    stream->seek(stream, 0, STREAM_SEEK_END);
+    uint32_t size = stream->tell(stream);
+    stream->seek(stream, 0, STREAM_SEEK_SET);
+
+    // Remember the position every 16 clusters, so seeking back doesn't
+    // walk the whole chain
+    fat_file_stream_checkpoints(stream, (void*)0x304000, 256, 16);
+
+    // The readahead buffer doesn't cross a 64K boundary, so the floppy can
+    // transfer it at once
+    fat_file_stream_readahead(stream, (void*)0x310000, 0x10000);
+
+    uint32_t sectorSize = ctx->header->bytesPerSector;
+    uint32_t loaded = 0;
+    while (loaded < size) {
+        uint32_t wanted = size - loaded < sectorSize ? size - loaded : sectorSize;
+        if (stream->read(stream, wanted, address + loaded) != wanted)
+            break;
+        loaded+= wanted;
+    }
+
+    stream->close(stream);
+    return loaded == size ? (int32_t)size : -1;
+}
+
 void main(){
     tty_init(80, 25, (void*)0xb8000);
     tty_clear();
@@ -77,6 +118,15 @@ void main(){
         tty_puts("Failed to load floppy drive");
     }
 
+    // Keep the sectors read in memory, so directories and the boot sector
+    // don't have to come from the floppy again
+    struct BlockDevice *cache = (void*)0x180000;
+    if(block_cache_get_device(cache, 0x80000, device)) {
+        device = cache;
+    } else {
+        tty_puts("Failed to create sector cache\n");
+    }
+
     struct FATContext *ctx =  (void*)0x200000;
     int resultCode;
     if((resultCode = fat_init_context(ctx, 0x100000, device)) != FAT_SUCCESS){
@@ -85,6 +135,10 @@ void main(){
         return;
     }
 
+    // Keep the directories and paths searched for files to load cached
+    fat_enable_directory_index(ctx, 0x10000);
+    fat_enable_path_cache(ctx, 32);
+
     snprintf(buffer, 50, "Bytes per sector           %8d\n", ctx->header->bytesPerSector);tty_puts(buffer);
     snprintf(buffer, 50, "Sectors per track          %8d\n", ctx->header->sectorsPerTrack);tty_puts(buffer);
     snprintf(buffer, 50, "Number of heads            %8d\n", ctx->header->numberOfHeads);tty_puts(buffer);
@@ -92,7 +146,7 @@ void main(){
     snprintf(buffer, 50, "First sector               %8d\n", ctx->header->hiddenSectors);tty_puts(buffer);
     snprintf(buffer, 50, "Number of sectors          %8d\n", ctx->header->smallNumberOfSectors ? ctx->header->smallNumberOfSectors : ctx->header->largeNumberOfSectors);tty_puts(buffer);
     snprintf(buffer, 50, "Reserved sectors           %8d\n", ctx->header->reservedSectors);tty_puts(buffer);
-    snprintf(buffer, 50, "Sectors per FAT            %8d\n", ctx->header->sectorsPerFat);tty_puts(buffer);
+    snprintf(buffer, 50, "Sectors per FAT            %8d\n", ctx->sectorsPerFat);tty_puts(buffer);
     snprintf(buffer, 50, "Fat copies                 %8d\n", ctx->header->numberOfFatCopies);tty_puts(buffer);
     snprintf(buffer, 50, "Sectors per cluster        %8d\n", ctx->header->sectorsPerCluster);tty_puts(buffer);
     snprintf(buffer, 50, "Root entries               %8d\n", ctx->header->numberOfRootEntries);tty_puts(buffer);
@@ -113,4 +167,12 @@ void main(){
     }
     snprintf(buffer, 50, "Found %d entries\n", count);
     tty_puts(buffer);
+
+    int32_t size = load_file(ctx, "KERNEL.BIN", (void*)0x400000);
+    if (size < 0) {
+        tty_puts("Failed to load KERNEL.BIN\n");
+        return;
+    }
+    snprintf(buffer, 50, "Loaded KERNEL.BIN          %8d\n", size);
+    tty_puts(buffer);
 }
\ No newline at end of file
@@ -0,0 +1,423 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include "check.h"
+
+// Only the first problems are described, the rest is only counted
+#define MAX_MESSAGES 32
+
+// Deeper then this is taken as a directory that loops
+#define MAX_DEPTH 32
+
+// Room for a slash and a 8.3 name at every level, and the terminator
+#define MAX_PATH (MAX_DEPTH * 13 + 1)
+
+// Returned by the walk when memory ran out, which isn't about the image
+#define WALK_NO_MEMORY -2
+
+/**
+ * A file or directory found while walking the tree
+ */
+struct Chain {
+    uint32_t cluster;
+    uint32_t size;
+    uint32_t directory;
+    char path[MAX_PATH];
+};
+
+/**
+ * Everything the workers share
+ */
+struct Check {
+    struct FATContext *ctx;
+    struct CheckResult *result;
+    uint32_t threads;
+    uint8_t *copies;
+    size_t copySize;
+    uint32_t *table;
+    uint32_t *owners;
+    struct Chain *chains;
+    uint32_t numberOfChains;
+    uint32_t capacity;
+    uint32_t messages;
+    pthread_mutex_t lock;
+};
+
+/**
+ * The part of the work a worker does
+ */
+struct Worker {
+    pthread_t thread;
+    struct Check *check;
+    uint32_t begin;
+    uint32_t end;
+};
+
+/**
+ * Counts a problem and describes it while there is room for messages
+ */
+static void report(struct Check *check, uint32_t *counter, const char *format, ...) {
+    pthread_mutex_lock(&check->lock);
+
+    (*counter)++;
+    if (check->messages++ < MAX_MESSAGES) {
+        va_list arguments;
+        va_start(arguments, format);
+        vprintf(format, arguments);
+        va_end(arguments);
+        printf("\n");
+    }
+
+    pthread_mutex_unlock(&check->lock);
+}
+
+/**
+ * Splits count items over the threads and runs the function on each part
+ */
+static int run_workers(struct Check *check, uint32_t begin, uint32_t end, void *(*function)(void*)) {
+    struct Worker *workers = malloc(check->threads * sizeof(struct Worker));
+    uint32_t count = end - begin;
+    uint32_t started = 0;
+
+    if (!workers)
+        return -1;
+
+    for (uint32_t index = 0; index < check->threads; index++) {
+        workers[index].check = check;
+        workers[index].begin = begin + (uint64_t)count * index / check->threads;
+        workers[index].end = begin + (uint64_t)count * (index + 1) / check->threads;
+
+        if (pthread_create(&workers[index].thread, 0, function, workers + index) != 0)
+            break;
+
+        started++;
+    }
+
+    for (uint32_t index = 0; index < started; index++)
+        pthread_join(workers[index].thread, 0);
+
+    free(workers);
+    return started == check->threads ? 0 : -1;
+}
+
+/**
+ * Compares the sectors of every FAT copy with the first one
+ */
+static void *compare_copies(void *argument) {
+    struct Worker *worker = argument;
+    struct Check *check = worker->check;
+    uint32_t bytesPerSector = check->ctx->header->bytesPerSector;
+
+    for (uint32_t copy = 1; copy < check->ctx->header->numberOfFatCopies; copy++) {
+        for (uint32_t sector = worker->begin; sector < worker->end; sector++) {
+            size_t offset = (size_t)sector * bytesPerSector;
+
+            if (memcmp(check->copies + offset, check->copies + copy * check->copySize + offset, bytesPerSector) != 0)
+                report(check, &check->result->mismatchedSectors, "FAT copy %d differs at sector %d", copy, sector);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Turns the entries of the first copy into plain numbers
+ */
+static void *decode_table(void *argument) {
+    struct Worker *worker = argument;
+    struct Check *check = worker->check;
+    const uint8_t *fat = check->copies;
+
+    for (uint32_t index = worker->begin; index < worker->end; index++) {
+        switch (check->ctx->type) {
+            case FAT12: {
+                uint32_t value = fat[index + index / 2] | (fat[index + index / 2 + 1] << 8);
+                check->table[index] = index & 1 ? value >> 4 : value & 0xFFF;
+            }
+            break;
+            case FAT16:
+                check->table[index] = ((const uint16_t*)fat)[index];
+            break;
+            default:
+                check->table[index] = ((const uint32_t*)fat)[index] & FAT32_MASK;
+            break;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Follows the chains, claiming every cluster for the chain. A cluster that
+ * was claimed already is cross-linked, or a loop when it's the same chain.
+ */
+static void *follow_chains(void *argument) {
+    struct Worker *worker = argument;
+    struct Check *check = worker->check;
+    struct FATContext *ctx = check->ctx;
+    size_t clusterSize = ctx->header->sectorsPerCluster * ctx->header->bytesPerSector;
+    uint32_t end = ctx->numberOfClusters + 2;
+    uint32_t eoc = ctx->type == FAT12 ? FAT12_EOC : ctx->type == FAT16 ? FAT16_EOC : FAT32_EOC;
+
+    for (uint32_t index = worker->begin; index < worker->end; index++) {
+        struct Chain *chain = check->chains + index;
+        uint32_t owner = index + 1;
+        uint32_t cluster = chain->cluster;
+        uint32_t length = 0;
+        int valid = 1;
+
+        if (cluster != 0 && (cluster < 2 || cluster >= end || check->table[cluster] == 0)) {
+            report(check, &check->result->invalidChains, "%s starts at free or invalid cluster %d", chain->path, cluster);
+            continue;
+        }
+
+        while (cluster != 0 && !fat_is_eoc(ctx, cluster)) {
+            uint32_t expected = 0;
+
+            if (!__atomic_compare_exchange_n(check->owners + cluster, &expected, owner, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                if (expected == owner) {
+                    report(check, &check->result->invalidChains, "%s loops at cluster %d", chain->path, cluster);
+                } else {
+                    report(check, &check->result->crossLinked, "%s is cross-linked at cluster %d", chain->path, cluster);
+                }
+
+                valid = 0;
+                break;
+            }
+
+            length++;
+            uint32_t next = check->table[cluster];
+
+            // Only a real end of chain mark may end it, not a bad cluster
+            if (next < eoc && (next < 2 || next >= end)) {
+                report(check, &check->result->invalidChains, "%s has an invalid link at cluster %d", chain->path, cluster);
+                valid = 0;
+                break;
+            }
+
+            if (next < eoc && check->table[next] == 0) {
+                report(check, &check->result->invalidChains, "%s continues into free cluster %d", chain->path, next);
+                valid = 0;
+                break;
+            }
+
+            cluster = next;
+        }
+
+        if (!valid)
+            continue;
+
+        if (chain->directory) {
+            if (length == 0)
+                report(check, &check->result->sizeMismatches, "%s is a directory without clusters", chain->path);
+        } else if (length != (chain->size + clusterSize - 1) / clusterSize) {
+            report(check, &check->result->sizeMismatches, "%s has a size of %d bytes that doesn't match its chain", chain->path, chain->size);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Finds used clusters that no chain claimed
+ */
+static void *find_lost(void *argument) {
+    struct Worker *worker = argument;
+    struct Check *check = worker->check;
+    struct FATContext *ctx = check->ctx;
+    uint32_t bad = ctx->type == FAT12 ? FAT12_EOC - 1 : ctx->type == FAT16 ? FAT16_EOC - 1 : FAT32_EOC - 1;
+
+    for (uint32_t cluster = worker->begin; cluster < worker->end; cluster++) {
+        uint32_t value = check->table[cluster];
+
+        if (value != 0 && value != bad && check->owners[cluster] == 0)
+            report(check, &check->result->lostClusters, "Cluster %d is used but not in any chain", cluster);
+    }
+
+    return 0;
+}
+
+/**
+ * Remembers a chain to follow, 0 when there is no memory for it
+ */
+static int add_chain(struct Check *check, const char *path, uint32_t cluster, uint32_t size, uint32_t directory) {
+    if (check->numberOfChains == check->capacity) {
+        uint32_t capacity = check->capacity ? check->capacity * 2 : 256;
+        struct Chain *chains = realloc(check->chains, capacity * sizeof(struct Chain));
+        if (!chains)
+            return 0;
+
+        check->chains = chains;
+        check->capacity = capacity;
+    }
+
+    struct Chain *chain = check->chains + check->numberOfChains++;
+    chain->cluster = cluster;
+    chain->size = size;
+    chain->directory = directory;
+    snprintf(chain->path, sizeof(chain->path), "%s", *path ? path : "/");
+    return 1;
+}
+
+/**
+ * Turns the short name of an entry back into NAME.EXT
+ */
+static void entry_name(const struct FATDirectoryEntry *entry, char *name) {
+    int length = 0;
+
+    for (int i = 0; i < 8 && entry->shortName[i] != ' '; i++)
+        name[length++] = entry->shortName[i];
+
+    if (entry->extension[0] != ' ') {
+        name[length++] = '.';
+
+        for (int i = 0; i < 3 && entry->extension[i] != ' '; i++)
+            name[length++] = entry->extension[i];
+    }
+
+    name[length] = '\0';
+}
+
+/**
+ * Collects the chains of the directory and everything below it with the
+ * directory reader, the walk itself uses the context so it isn't threaded
+ */
+static int walk_directory(struct Check *check, const char *path, uint32_t depth) {
+    struct FATContext *ctx = check->ctx;
+    struct FATDirectoryEntry entry;
+
+    if (depth == MAX_DEPTH) {
+        report(check, &check->result->invalidChains, "%s is nested too deep", path);
+        return 0;
+    }
+
+    struct FATDirectory *directory = malloc(fat_directory_size(ctx));
+    if (!directory)
+        return WALK_NO_MEMORY;
+
+    if (fat_open_directory(ctx, directory, path) != FAT_SUCCESS) {
+        free(directory);
+        return -1;
+    }
+
+    while (fat_read_directory(ctx, directory, &entry)) {
+        uint32_t cluster = entry.firstClusterLowWord | (entry.firstClusterHighWord << 16);
+        char name[13];
+        char child[MAX_PATH];
+
+        if (entry.name[0] == '.' || entry.attributes.volumeId)
+            continue;
+
+        entry_name(&entry, name);
+        snprintf(child, sizeof(child), "%s/%s", path, name);
+
+        if (!add_chain(check, child, cluster, entry.attributes.directory ? 0 : entry.fileSize, entry.attributes.directory)) {
+            free(directory);
+            return WALK_NO_MEMORY;
+        }
+
+        if (!entry.attributes.directory) {
+            check->result->files++;
+            continue;
+        }
+
+        check->result->directories++;
+
+        // A directory without clusters is reported with the chains
+        if (cluster != 0) {
+            int resultCode = walk_directory(check, child, depth + 1);
+            if (resultCode == WALK_NO_MEMORY) {
+                free(directory);
+                return WALK_NO_MEMORY;
+            }
+
+            if (resultCode != 0)
+                report(check, &check->result->invalidChains, "%s can't be read", child);
+        }
+    }
+
+    free(directory);
+    return 0;
+}
+
+int check_image(struct FATContext *ctx, uint32_t threads, struct CheckResult *result) {
+    struct Check check;
+    uint32_t bytesPerSector = ctx->header->bytesPerSector;
+    uint32_t copies = ctx->header->numberOfFatCopies;
+    uint32_t end = ctx->numberOfClusters + 2;
+    int resultCode = -1;
+
+    memset(result, 0, sizeof(struct CheckResult));
+    memset(&check, 0, sizeof(struct Check));
+    check.ctx = ctx;
+    check.result = result;
+    check.threads = threads ? threads : 1;
+    check.copySize = (size_t)ctx->sectorsPerFat * bytesPerSector;
+    pthread_mutex_init(&check.lock, 0);
+
+    // All copies in one go, a FAT12 entry may read a byte past the end
+    check.copies = malloc(check.copySize * copies + 1);
+    check.table = malloc(end * sizeof(uint32_t));
+    check.owners = calloc(end, sizeof(uint32_t));
+    if (!check.copies || !check.table || !check.owners)
+        goto cleanup;
+
+    uint32_t sectors = ctx->sectorsPerFat * copies;
+    if (ctx->device->read(ctx->device, ctx->header->reservedSectors, sectors, check.copies) != sectors) {
+        printf("Failed to read the FAT copies\n");
+        goto cleanup;
+    }
+
+    check.copies[check.copySize * copies] = 0;
+
+    // The table must be able to hold every cluster
+    uint32_t bytesNeeded = ctx->type == FAT12 ? end + end / 2 + 1 : end * (ctx->type == FAT16 ? 2 : 4);
+    if (bytesNeeded > check.copySize) {
+        printf("The FAT is too small for %d clusters\n", ctx->numberOfClusters);
+        goto cleanup;
+    }
+
+    if (run_workers(&check, 0, ctx->sectorsPerFat, compare_copies) != 0)
+        goto cleanup;
+
+    if (run_workers(&check, 0, end, decode_table) != 0)
+        goto cleanup;
+
+    // The root of FAT12 and FAT16 isn't a chain
+    if (ctx->extended && !add_chain(&check, "", ctx->extended->rootCluster, 0, 1)) {
+        printf("Out of memory\n");
+        goto cleanup;
+    }
+
+    int walked = walk_directory(&check, "", 0);
+    if (walked == WALK_NO_MEMORY) {
+        printf("Out of memory\n");
+        goto cleanup;
+    }
+
+    if (walked != 0) {
+        printf("Failed to read the root directory\n");
+        goto cleanup;
+    }
+
+    if (run_workers(&check, 0, check.numberOfChains, follow_chains) != 0)
+        goto cleanup;
+
+    if (run_workers(&check, 2, end, find_lost) != 0)
+        goto cleanup;
+
+    if (check.messages > MAX_MESSAGES)
+        printf("... %d more problems\n", check.messages - MAX_MESSAGES);
+
+    resultCode = check.messages ? 1 : 0;
+
+    cleanup:
+    free(check.copies);
+    free(check.table);
+    free(check.owners);
+    free(check.chains);
+    pthread_mutex_destroy(&check.lock);
+    return resultCode;
+}
@@ -0,0 +1,33 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <fs/fat.h>
+
+/**
+ * Numbers of problems found by check_image
+ */
+struct CheckResult {
+    uint32_t files;
+    uint32_t directories;
+    uint32_t mismatchedSectors;
+    uint32_t invalidChains;
+    uint32_t crossLinked;
+    uint32_t lostClusters;
+    uint32_t sizeMismatches;
+};
+
+/**
+ * Checks the consistency of the filesystem: the FAT copies must be equal,
+ * every chain must be valid, no cluster may be in two chains, every used
+ * cluster must belong to a chain and the size of a file must match its
+ * chain. The work on the table is split over the threads.
+ *
+ * @param ctx       The context
+ * @param threads   Number of worker threads
+ * @param result    Receives the numbers of problems found
+ * @return 0 when the image is consistent, 1 when problems were found and
+ *         -1 when the image couldn't be checked
+ */
+int check_image(struct FATContext *ctx, uint32_t threads, struct CheckResult *result);
+
+#endif
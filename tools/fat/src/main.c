@@ -1,8 +1,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <driver/posix.h>
+#include <io/cache.h>
+#include <io/log.h>
+#include <io/queue.h>
 #include <fs/fat.h>
+#include <unistd.h>
+#include "check.h"
+
+// Number of sectors to keep in memory of an opened image
+#define IMAGE_CACHE_SECTORS 256
+
+// Number of changed sectors the log of an opened image keeps in memory
+#define IMAGE_LOG_SECTORS 512
+
+// Number of files moved in a single pass of the defragmenter
+#define DEFRAG_PLAN_FILES 256
+
+// Size of the buffer the defragmenter copies clusters through
+#define DEFRAG_BUFFER_SIZE 0x100000
+
+// Number of sectors the queue of a loaded file merges requests into
+#define LOAD_QUEUE_SECTORS 256
+
+// Size of the memory a loaded file reads ahead in
+#define LOAD_READAHEAD_SIZE 0x40000
+
+// Size of the pieces a loaded file is read and written in
+#define LOAD_CHUNK_SIZE 0x100000
+
+// Number of clusters the position is remembered at while loading a file
+#define LOAD_CHECKPOINTS 64
 
 /**
  * Print the help info
@@ -25,10 +55,19 @@ static int print_help(int value) {
     printf("  -e N    Maximum number of root entries\n");
     printf("  -h N    Number of hidden sectors preceding the filesystem\n");
     printf("  -c N    Number of sectors per cluster\n");
+    printf("  -l N    Number of reserved sectors to keep a write-ahead log in (min 3)\n");
+    printf("  -z      Write zeros to the whole image instead of leaving it sparse\n");
+    printf("  -d      Write the filesystem with direct I/O, bypassing the page cache\n");
     printf(" fat list <file> [path]\n");
-    printf(" fat load <file> <path> <destination>\n");
+    printf(" fat load <file> <path> <destination> [options]\n");
+    printf("  -d      Read the image with direct I/O, bypassing the page cache\n");
     printf(" fat store <file> <path> <source>\n");
     printf(" fat remove <file> <path>\n");
+    printf(" fat defrag <file>\n");
+    printf("  Files are only moved into free space, a file stays fragmented when\n");
+    printf("  no free run is as long as it\n");
+    printf(" fat check <file> [options]\n");
+    printf("  -j N    Number of threads, defaults to the number of processors\n");
     return value;
 }
 
@@ -51,7 +90,7 @@ static void print_info(struct FATContext *ctx) {
     printf("--- Header ---\n");
     printf("OEM Name                 \"%8.8s\"\n", ctx->header->oemName);
 	printf("Reserved sectors           %8d\n", ctx->header->reservedSectors);
-    printf("Sectors per FAT            %8d\n", ctx->header->sectorsPerFat);
+    printf("Sectors per FAT            %8d\n", ctx->sectorsPerFat);
     printf("Fat copies                 %8d\n", ctx->header->numberOfFatCopies);
     printf("Sectors per cluster        %8d\n", ctx->header->sectorsPerCluster);
 	printf("Root entries               %8d\n", ctx->header->numberOfRootEntries);
@@ -65,6 +104,10 @@ static void print_info(struct FATContext *ctx) {
 		printf("Root cluster                %8d\n", ctx->extended->rootCluster);
 		printf("fileSystemInfoSector        %8d\n", ctx->extended->fileSystemInfoSector);
 		printf("Backup BootSector           %8d\n", ctx->extended->backupBootSector);
+		if (ctx->freeClusters != FAT_FSINFO_UNKNOWN)
+			printf("Free clusters (FSInfo)      %8d\n", ctx->freeClusters);
+		if (ctx->nextFree != FAT_FSINFO_UNKNOWN)
+			printf("Next free cluster (FSInfo)  %8d\n", ctx->nextFree);
 		printf("\n");
 	}
 
@@ -88,9 +131,212 @@ static void print_info(struct FATContext *ctx) {
     printf("Start root directory       %8d\n", ctx->startOfRootDirectory);
     printf("First data sector          %8d\n", ctx->startOfData);
     printf("Number of clusters         %8d\n", ctx->numberOfClusters);
+    if (ctx->freeMap)
+        printf("Free clusters              %8d\n", fat_count_free(ctx));
     printf("Buffer size                %8ld\n", ctx->bufferSize);
 }
 
+/**
+ * Puts the changes a crash left in the write-ahead log of the image in their
+ * place, before anything reads the image
+ *
+ * @param      device  The device of the image
+ *
+ * @return     0 when the log couldn't be replayed
+ */
+static int replay_log(struct BlockDevice *device) {
+    void *buffer = malloc(device->blockSize * 2);
+    int resultCode = 1;
+
+    if (device->read(device, 0, 1, buffer) == 1) {
+        struct FATBPB *bpb = buffer + 3;
+
+        // The log keeps its state in the last reserved sector
+        if (bpb->header.reservedSectors > 1)
+            resultCode = block_log_replay(device, bpb->header.reservedSectors - 1, buffer) >= 0;
+    }
+
+    free(buffer);
+    return resultCode;
+}
+
+/**
+ * Gives the local date and time for the entries that are written
+ *
+ * @param      today  Receives the date
+ * @param      now    Receives the time
+ */
+static void local_clock(struct FATDate *today, struct FATTime *now) {
+    time_t seconds = time(0);
+    struct tm *local = localtime(&seconds);
+
+    // FAT counts from 1980 and in steps of two seconds
+    today->year = local->tm_year - 80;
+    today->month = local->tm_mon + 1;
+    today->day = local->tm_mday;
+    now->hours = local->tm_hour;
+    now->minutes = local->tm_min;
+    now->seconds = local->tm_sec / 2;
+}
+
+/**
+ * Opens an image with a sector cache in front of it
+ *
+ * @param[in]  filename  The image file
+ *
+ * @return     The device or 0 on failure
+ */
+static struct BlockDevice *open_image(const char *filename) {
+    struct BlockDevice *device = malloc(posix_stream_device_size());
+    if(!posix_get_stream_device(device, filename, 512)){
+        free(device);
+        return 0;
+    }
+
+    size_t size = block_cache_device_size(device, IMAGE_CACHE_SECTORS);
+    struct BlockDevice *cache = malloc(size);
+    if(!replay_log(device) || !block_cache_get_device(cache, size, device)){
+        device->action(device, BLOCK_DEVICE_CLOSE);
+        free(device);
+        free(cache);
+        return 0;
+    }
+
+    return cache;
+}
+
+/**
+ * Writes back the cached sectors and closes the image
+ *
+ * @param      cache  The device returned by open_image
+ */
+static void close_image(struct BlockDevice *cache) {
+    struct BlockDevice *device = (void*)block_cache_get_source(cache);
+
+    cache->action(cache, BLOCK_DEVICE_CLOSE);
+    free(device);
+    free(cache);
+}
+
+/**
+ * Maps an image into memory, reading it doesn't take a call for every sector
+ *
+ * @param[in]  filename  The image file
+ *
+ * @return     The device or 0 on failure
+ */
+static struct BlockDevice *open_mapped_image(const char *filename) {
+    struct BlockDevice *device = malloc(posix_mapped_device_size());
+    if(!posix_get_mapped_device(device, filename, 512)){
+        free(device);
+        return 0;
+    }
+
+    if(!replay_log(device)){
+        device->action(device, BLOCK_DEVICE_CLOSE);
+        free(device);
+        return 0;
+    }
+
+    return device;
+}
+
+/**
+ * Writes back the changes and unmaps the image
+ *
+ * @param      device  The device returned by open_mapped_image
+ */
+static void close_mapped_image(struct BlockDevice *device) {
+    device->action(device, BLOCK_DEVICE_CLOSE);
+    free(device);
+}
+
+/**
+ * Opens an image with positional reads and writes, requests submitted to it
+ * complete asynchronously
+ *
+ * @param[in]  filename  The image file
+ * @param[in]  direct    Non zero to bypass the page cache
+ *
+ * @return     The device or 0 on failure
+ */
+static struct BlockDevice *open_file_image(const char *filename, int direct) {
+    struct BlockDevice *device = malloc(posix_file_device_size());
+    if(!posix_get_file_device(device, filename, 512, direct)){
+        free(device);
+        return 0;
+    }
+
+    if(!replay_log(device)){
+        device->action(device, BLOCK_DEVICE_CLOSE);
+        free(device);
+        return 0;
+    }
+
+    return device;
+}
+
+/**
+ * Waits for what was submitted and closes the image
+ *
+ * @param      device  The device returned by open_file_image
+ */
+static void close_file_image(struct BlockDevice *device) {
+    device->action(device, BLOCK_DEVICE_CLOSE);
+    free(device);
+}
+
+/**
+ * Puts the write-ahead log of the image in front of it, when it has one. The
+ * context is initialized again on the log.
+ *
+ * @param      cache  The device returned by open_image
+ * @param      ctx    Context initialized on the cache
+ * @param[in]  size   Size of the context
+ *
+ * @return     The log device, or the cache when there is no log
+ */
+static struct BlockDevice *open_log(struct BlockDevice *cache, struct FATContext *ctx, size_t size) {
+    if (ctx->header->reservedSectors < 4)
+        return cache;
+
+    size_t logSize = block_log_device_size(cache, IMAGE_LOG_SECTORS);
+    struct BlockDevice *log = malloc(logSize);
+    if (!block_log_get_device(log, logSize, cache, ctx->header->reservedSectors - 1, ctx->startOfData)) {
+        free(log);
+        return cache;
+    }
+
+    if (fat_init_context(ctx, size, log) != FAT_SUCCESS) {
+        free(log);
+        fat_init_context(ctx, size, cache);
+        return cache;
+    }
+
+    return log;
+}
+
+/**
+ * Checkpoints the log and closes the image
+ *
+ * @param      image  The device returned by open_log
+ * @param      cache  The device returned by open_image
+ */
+static void close_logged_image(struct BlockDevice *image, struct BlockDevice *cache) {
+    if (image == cache) {
+        close_image(cache);
+        return;
+    }
+
+    // Closing the log closes the devices below it
+    struct BlockDevice *device = (void*)block_cache_get_source(cache);
+
+    image->action(image, BLOCK_DEVICE_CLOSE);
+    free(device);
+    free(cache);
+    free(image);
+}
+
 /**
  * Show info about the image
  * 
@@ -108,6 +354,9 @@ static inline int main_create(int argc, char** argv) {
     struct FATCreateParams parameters;
     memset(&parameters, 0, sizeof(struct FATHeader));
     uint16_t blockSize = 512;
+    uint32_t logSectors = 0;
+    int zero = 0;
+    int direct = 0;
     uint32_t i;
     uint8_t s[12];
 
@@ -209,14 +458,41 @@ static inline int main_create(int argc, char** argv) {
                 index++;
                 strncpy(parameters.volumeLabel, argv[index], 11);
             break;
+            case 'z':
+                zero = 1;
+            break;
+            case 'd':
+                direct = 1;
+            break;
+            case 'l':
+                index++;
+                if (!sscanf(argv[index], "%i", &i) || i < 3) {
+                    printf("Failed to parse <logSectors>\n");
+                    return print_help(1);
+                }
+                logSectors = i;
+            break;
             default:
                 printf("Unknown argument '%s'\n", argv[index]);
                 return print_help(1);
         }
     }
 
-    struct BlockDevice *device = malloc(posix_stream_device_size());
-    if(!posix_create_stream_device(device, argv[0], blockSize, parameters.numberOfSectors)){
+    // The log comes after the sectors that are reserved otherwise, which
+    // defaults to the 32 of FAT32 as the type isn't known yet
+    if (logSectors)
+        parameters.reservedSectors = (parameters.reservedSectors ? parameters.reservedSectors : 32) + logSectors;
+
+    // The stream only sizes the image, the filesystem goes in with
+    // positional writes that skip the buffering of the stream
+    struct BlockDevice *stream = malloc(posix_stream_device_size());
+    int created = posix_create_stream_device(stream, argv[0], blockSize, parameters.numberOfSectors, zero);
+    if (created)
+        stream->action(stream, BLOCK_DEVICE_CLOSE);
+    free(stream);
+
+    struct BlockDevice *device = malloc(posix_file_device_size());
+    if(!created || !posix_get_file_device(device, argv[0], blockSize, direct)){
         printf("Failed to open file command '%s'\n", argv[0]);
         free(device);
         return 1;
@@ -226,14 +502,22 @@ static inline int main_create(int argc, char** argv) {
     int resultCode;
     if((resultCode = fat_create(ctx, 0x100000, device, &parameters)) != FAT_SUCCESS){
         printf("Failed to create filesystem %d\n", resultCode);
-        device->action(device, BLOCK_DEVICE_CLOSE);
-        free(device);
+        close_file_image(device);
+        free(ctx);
+        return 1;
+    }
+
+    if (logSectors && !block_log_format(device, parameters.reservedSectors - logSectors, logSectors, ctx->buffer)) {
+        printf("Failed to create the log\n");
+        close_file_image(device);
         free(ctx);
         return 1;
     }
 
     print_info(ctx);
 
+    close_file_image(device);
+    free(ctx);
     return 0;
 }
 
@@ -251,10 +535,9 @@ static inline int main_info(int argc, char** argv) {
         return print_help(1);
     }
 
-    struct BlockDevice *device = malloc(posix_stream_device_size());
-    if(!posix_get_stream_device(device, argv[0], 512)){
+    struct BlockDevice *device = open_mapped_image(argv[0]);
+    if(!device){
         printf("Failed to open file command '%s'\n", argv[0]);
-        free(device);
         return 1;
     }
 
@@ -262,16 +545,21 @@ static inline int main_info(int argc, char** argv) {
     int resultCode;
     if((resultCode = fat_init_context(ctx, 0x100000, device)) != FAT_SUCCESS){
         printf("Failed to load filesystem %d\n", resultCode);
-        device->action(device, BLOCK_DEVICE_CLOSE);
-        free(device);
+        close_mapped_image(device);
         free(ctx);
         return 1;
     }
 
+    // Without the free map the free clusters are just left out
+    uint32_t *freeMap = malloc(fat_free_map_size(ctx));
+    if (freeMap)
+        fat_enable_free_map(ctx, freeMap, fat_free_map_size(ctx));
+
     print_info(ctx);
 
-    device->action(device, BLOCK_DEVICE_CLOSE);
-    free(device);
+    ctx->freeMap = 0;
+    free(freeMap);
+    close_mapped_image(device);
     free(ctx);
     return 0;
 }
@@ -290,10 +578,9 @@ static inline int main_list(int argc, char** argv) {
         return print_help(1);
     }
 
-    struct BlockDevice *device = malloc(posix_stream_device_size());
-    if(!posix_get_stream_device(device, argv[0], 512)){
+    struct BlockDevice *device = open_mapped_image(argv[0]);
+    if(!device){
         printf("Failed to open file command '%s'\n", argv[0]);
-        free(device);
         return 1;
     }
 
@@ -303,31 +590,27 @@ static inline int main_list(int argc, char** argv) {
         goto error;
     }
 
+    // Walking the chains is cheaper with the table expanded
+    if (ctx->type == FAT12)
+        fat_expand_table(ctx);
+
     const char *path = "";
     if(argc >= 2)
         path = argv[1];
 
-    struct FATDirectoryEntry directory;
-    int32_t count = fat_find_file(ctx, &directory, 1, path);
-    if (count <= 0) {
+    struct FATDirectory *directory = malloc(fat_directory_size(ctx));
+    if (fat_open_directory(ctx, directory, path) != FAT_SUCCESS) {
         printf("Directory not found\n");
-        goto error;
-    }
-
-    printf("Found %d entries\n", count);
-
-    struct FATDirectoryEntry *entries = malloc(sizeof(struct FATDirectoryEntry) * count);
-
-    if (fat_find_file(ctx, entries, count, path) != count){
-        printf("Failed to read entries\n");
-        free(entries);
+        free(directory);
         goto error;
     }
 
     printf("\n");
 
-    struct FATDirectoryEntry *cursor = entries;
-    for(int32_t index = 0; index < count; index++, cursor++) {
+    struct FATDirectoryEntry entry;
+    struct FATDirectoryEntry *cursor = &entry;
+    int32_t count = 0;
+    while (fat_read_directory(ctx, directory, &entry)) {
         printf("%.8s %.3s %c%c%c%c%c %8d %8d - %02d-%02d-%04d %02d:%02d:%02d - %02d-%02d-%04d %02d:%02d:%02d\n",
             cursor->shortName,
             cursor->extension,
@@ -343,25 +626,26 @@ static inline int main_list(int argc, char** argv) {
             cursor->created.date.year + 1980,
             cursor->created.time.hours,
             cursor->created.time.minutes,
-            cursor->created.time.seconds,
+            cursor->created.time.seconds * 2,
             cursor->modified.date.day,
             cursor->modified.date.month,
             cursor->modified.date.year + 1980,
             cursor->modified.time.hours,
             cursor->modified.time.minutes,
-            cursor->modified.time.seconds
+            cursor->modified.time.seconds * 2
         );
+        count++;
     }
-    free(entries);
 
-    device->action(device, BLOCK_DEVICE_CLOSE);
-    free(device);
+    printf("\nFound %d entries\n", count);
+    free(directory);
+
+    close_mapped_image(device);
     free(ctx);
     return 0;
     
     error:
-    device->action(device, BLOCK_DEVICE_CLOSE);
-    free(device);
+    close_mapped_image(device);
     free(ctx);
     return 1;
 }
@@ -380,78 +664,121 @@ static inline int main_load(int argc, char** argv) {
         return print_help(1);
     }
 
-    struct BlockDevice *device = malloc(posix_stream_device_size());
-    if(!posix_get_stream_device(device, argv[0], 512)){
+    int direct = 0;
+    for(int index = 3; index < argc; index++){
+        if(strcmp(argv[index], "-d") != 0) {
+            printf("Unknown argument '%s'\n", argv[index]);
+            return print_help(1);
+        }
+        direct = 1;
+    }
+
+    struct BlockDevice *device = open_file_image(argv[0], direct);
+    if(!device){
         printf("Failed to open file command '%s'\n", argv[0]);
-        free(device);
         return 1;
     }
 
     struct FATContext *ctx =  malloc(0x100000);
+    stream_t *stream = malloc(fat_file_stream_size());
+    size_t size = block_queue_size(device, LOAD_QUEUE_SECTORS);
+    struct BlockQueue *queue = malloc(size);
+    uint32_t *checkpoints = malloc(LOAD_CHECKPOINTS * sizeof(uint32_t));
+    void *readahead = 0;
+    void *buffer = 0;
+    FILE *f = 0;
+    int opened = 0;
+
+    // The memory the device reads into must suit its alignment
+    size_t alignment = device->alignment > 1 ? device->alignment : sizeof(void*);
+    if (posix_memalign(&readahead, alignment, LOAD_READAHEAD_SIZE) != 0)
+        readahead = 0;
+    if (posix_memalign(&buffer, alignment, LOAD_CHUNK_SIZE) != 0)
+        buffer = 0;
+
+    if (!ctx || !stream || !queue || !checkpoints || !readahead || !buffer) {
+        printf("Out of memory\n");
+        goto error;
+    }
+
     if(fat_init_context(ctx, 0x100000, device) != FAT_SUCCESS){
         printf("Failed to load filesystem\n");
         goto error;
     }
 
-    struct FATDirectoryEntry entry;
-    int32_t count = fat_find_file(ctx, &entry, 1, argv[1]);
-    
-    if (count <= 0) {
+    // Walking the chains is cheaper with the table expanded
+    if (ctx->type == FAT12)
+        fat_expand_table(ctx);
+
+    if (fat_open_file(ctx, stream, argv[1]) != FAT_SUCCESS) {
         printf("File not found\n");
         goto error;
     }
 
-    if(entry.attributes.directory) {
-        printf("Path is a directory\n");
+    opened = 1;
+    stream->seek(stream, 0, STREAM_SEEK_END);
+    size_t fileSize = stream->tell(stream);
+    stream->seek(stream, 0, STREAM_SEEK_SET);
+
+    // Spread the checkpoints over the whole chain
+    uint32_t clusterSize = ctx->header->sectorsPerCluster * ctx->header->bytesPerSector;
+    uint32_t clusters = (fileSize + clusterSize - 1) / clusterSize;
+    fat_file_stream_checkpoints(stream, checkpoints, LOAD_CHECKPOINTS, clusters / LOAD_CHECKPOINTS + 1);
+
+    // The pieces of the chain are all submitted before waiting for them
+    if (!block_queue_init(queue, size, device)
+        || fat_file_stream_queue(stream, queue) != FAT_SUCCESS
+        || fat_file_stream_readahead(stream, readahead, LOAD_READAHEAD_SIZE) != FAT_SUCCESS) {
+        printf("Failed to set up reading the file\n");
         goto error;
     }
 
-    FILE *f = fopen(argv[2], "w");
+    f = fopen(argv[2], "w");
     if (!f) {
         printf("Failed to open file\n");
         goto error;
     }
 
-    size_t bufferSize = ctx->header->sectorsPerCluster * ctx->header->bytesPerSector;
-    void *buffer = malloc(bufferSize);
-    uint32_t clusterIndex = entry.firstClusterLowWord | (entry.firstClusterHighWord << 16);
-    uint32_t remainSize = entry.fileSize;
-    uint32_t writeSize = bufferSize;
+    size_t total = 0;
+    while (total < fileSize) {
+        size_t wanted = fileSize - total < LOAD_CHUNK_SIZE ? fileSize - total : LOAD_CHUNK_SIZE;
+        size_t read = stream->read(stream, wanted, buffer);
 
-    do {
-        size_t read = fat_read_cluster(ctx, clusterIndex, buffer, bufferSize);
-        if (read != bufferSize) {
-            printf("Failed to read cluster (%d != %d)\n", (uint32_t)read, (uint32_t)bufferSize);
-            free(buffer);
-            fclose(f);
+        if (read != wanted) {
+            printf("Cluster chain is shorter then the file (%d != %d)\n", (uint32_t)(total + read), (uint32_t)fileSize);
             goto error;
         }
 
-        if(remainSize < writeSize)
-            writeSize = remainSize;
-
-        size_t written = fwrite(buffer, 1, writeSize, f);
-        if (written != writeSize) {
-            printf("Failed to write to file (%d != %d)\n", (uint32_t)written, (uint32_t)writeSize);
-            free(buffer);
-            fclose(f);
+        if (fwrite(buffer, 1, read, f) != read) {
+            printf("Failed to write to file\n");
             goto error;
         }
-        remainSize-= writeSize;
 
-        clusterIndex = fat_next_cluster(ctx, clusterIndex);
-    } while (!fat_is_eoc(ctx, clusterIndex));
+        total+= read;
+    }
 
     fclose(f);
-
-    device->action(device, BLOCK_DEVICE_CLOSE);
-    free(device);
+    stream->close(stream);
+    free(stream);
+    free(queue);
+    free(checkpoints);
+    free(readahead);
+    free(buffer);
+    close_file_image(device);
     free(ctx);
     return 0;
     
     error:
-    device->action(device, BLOCK_DEVICE_CLOSE);
-    free(device);
+    if (f)
+        fclose(f);
+    if (opened)
+        stream->close(stream);
+    free(stream);
+    free(queue);
+    free(checkpoints);
+    free(readahead);
+    free(buffer);
+    close_file_image(device);
     free(ctx);
     return 1;
 }
@@ -471,19 +798,23 @@ static inline int main_store(int argc, char** argv) {
         return print_help(1);
     }
 
-    struct BlockDevice *device = malloc(posix_stream_device_size());
-    if(!posix_get_stream_device(device, argv[0], 512)){
+    struct BlockDevice *device = open_image(argv[0]);
+    if(!device){
         printf("Failed to open file command '%s'\n", argv[0]);
-        free(device);
         return 1;
     }
 
+    struct BlockDevice *image = device;
     struct FATContext *ctx =  malloc(0x100000);
     if(fat_init_context(ctx, 0x100000, device) != FAT_SUCCESS){
         printf("Failed to load filesystem\n");
         goto error;
     }
 
+    // Changes to the metadata go through the log when the image has one
+    image = open_log(device, ctx, 0x100000);
+    fat_set_clock(ctx, local_clock);
+
     FILE *f = fopen(argv[2], "rb");
     if (!f) {
         printf("Failed to open file\n");
@@ -516,29 +847,218 @@ static inline int main_store(int argc, char** argv) {
     printf("Load file with size of %d\n", (int)size);
 
     uint32_t startIndex, endIndex;
-    if (sscanf(argv[1], "%i:%i", &startIndex, &endIndex)) {
+    if (sscanf(argv[1], "%i:%i", &startIndex, &endIndex) == 2) {
         printf("setting reseved @ %d:%d\n", startIndex, endIndex);
 
         if(fat_set_reserved(ctx, startIndex, endIndex, buffer, size) != FAT_SUCCESS){
             printf("Failed to set reserved sectors\n");
+            free(buffer);
             goto error;
         }
     } else {
-        printf("Not supported yet\n");
+        // The whole table is written once at the end
+        if (ctx->type == FAT12)
+            fat_expand_table(ctx);
+
+        // With the free map the file is placed in as few pieces as possible,
+        // without it the table is searched for free clusters instead
+        uint32_t *freeMap = malloc(fat_free_map_size(ctx));
+        if (freeMap)
+            fat_enable_free_map(ctx, freeMap, fat_free_map_size(ctx));
+
+        int resultCode = fat_store_file(ctx, argv[1], buffer, size);
+        ctx->freeMap = 0;
+        free(freeMap);
+
+        if (resultCode != FAT_SUCCESS) {
+            printf("Failed to store file\n");
+            free(buffer);
+            goto error;
+        }
     }
 
-    device->action(device, BLOCK_DEVICE_CLOSE);
-    free(device);
+    free(buffer);
+    close_logged_image(image, device);
     free(ctx);
     return 0;
     
     error:
-    device->action(device, BLOCK_DEVICE_CLOSE);
-    free(device);
+    close_logged_image(image, device);
     free(ctx);
     return 1;
 }
 
+/**
+ * Remove a file from the image
+ * 
+ * @param[in]  argc  The argc
+ * @param      argv  The argv
+ *
+ * @return     program exit code
+ */
+static inline int main_remove(int argc, char** argv) {
+    if(argc < 2){
+        printf("Not enough arguments\n");
+        return print_help(1);
+    }
+
+    struct BlockDevice *device = open_image(argv[0]);
+    if(!device){
+        printf("Failed to open file command '%s'\n", argv[0]);
+        return 1;
+    }
+
+    struct BlockDevice *image = device;
+    struct FATContext *ctx =  malloc(0x100000);
+    if(fat_init_context(ctx, 0x100000, device) != FAT_SUCCESS){
+        printf("Failed to load filesystem\n");
+        goto error;
+    }
+
+    // Changes to the metadata go through the log when the image has one
+    image = open_log(device, ctx, 0x100000);
+
+    if (ctx->type == FAT12)
+        fat_expand_table(ctx);
+
+    if (fat_remove_file(ctx, argv[1]) != FAT_SUCCESS) {
+        printf("Failed to remove file\n");
+        goto error;
+    }
+
+    close_logged_image(image, device);
+    free(ctx);
+    return 0;
+    
+    error:
+    close_logged_image(image, device);
+    free(ctx);
+    return 1;
+}
+
+/**
+ * Move the fragmented files of the image to contiguous runs
+ * 
+ * @param[in]  argc  The argc
+ * @param      argv  The argv
+ *
+ * @return     program exit code
+ */
+static inline int main_defrag(int argc, char** argv) {
+    if(argc < 1){
+        printf("Not enough arguments\n");
+        return print_help(1);
+    }
+
+    struct BlockDevice *device = open_image(argv[0]);
+    if(!device){
+        printf("Failed to open file command '%s'\n", argv[0]);
+        return 1;
+    }
+
+    struct FATContext *ctx =  malloc(0x100000);
+    if(fat_init_context(ctx, 0x100000, device) != FAT_SUCCESS){
+        printf("Failed to load filesystem\n");
+        close_image(device);
+        free(ctx);
+        return 1;
+    }
+
+    // Changes to the metadata go through the log when the image has one
+    struct BlockDevice *image = open_log(device, ctx, 0x100000);
+
+    if (ctx->type == FAT12)
+        fat_expand_table(ctx);
+
+    uint32_t *freeMap = malloc(fat_free_map_size(ctx));
+    size_t planSize = fat_defrag_plan_size(DEFRAG_PLAN_FILES);
+    struct FATDefragMove *plan = malloc(planSize);
+    void *buffer = malloc(DEFRAG_BUFFER_SIZE);
+
+    int resultCode = FAT_ERROR;
+    if (!freeMap || !plan || !buffer) {
+        printf("Out of memory\n");
+    } else if (fat_enable_free_map(ctx, freeMap, fat_free_map_size(ctx)) != FAT_SUCCESS) {
+        printf("Failed to build the free map\n");
+    } else {
+        uint32_t moved, fragmented;
+        resultCode = fat_defragment(ctx, plan, planSize, buffer, DEFRAG_BUFFER_SIZE, &moved, &fragmented);
+        if (resultCode != FAT_SUCCESS) {
+            printf("Failed to defragment after moving %d files\n", moved);
+        } else {
+            printf("Moved %d files\n", moved);
+            if (fragmented)
+                printf("Left %d files fragmented, there is no free run they fit in\n", fragmented);
+        }
+    }
+
+    ctx->freeMap = 0;
+    free(buffer);
+    free(plan);
+    free(freeMap);
+    close_logged_image(image, device);
+    free(ctx);
+    return resultCode == FAT_SUCCESS ? 0 : 1;
+}
+
+/**
+ * Check the consistency of the image
+ * 
+ * @param[in]  argc  The argc
+ * @param      argv  The argv
+ *
+ * @return     program exit code
+ */
+static inline int main_check(int argc, char** argv) {
+    if(argc < 1){
+        printf("Not enough arguments\n");
+        return print_help(1);
+    }
+
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            threads = strtol(argv[++i], 0, 0);
+        } else {
+            printf("Unknown option '%s'\n", argv[i]);
+            return print_help(1);
+        }
+    }
+
+    if (threads < 1)
+        threads = 1;
+
+    struct BlockDevice *device = open_mapped_image(argv[0]);
+    if(!device){
+        printf("Failed to open file command '%s'\n", argv[0]);
+        return 1;
+    }
+
+    struct FATContext *ctx =  malloc(0x100000);
+    if(fat_init_context(ctx, 0x100000, device) != FAT_SUCCESS){
+        printf("Failed to load filesystem\n");
+        close_mapped_image(device);
+        free(ctx);
+        return 1;
+    }
+
+    struct CheckResult result;
+    int resultCode = check_image(ctx, threads, &result);
+
+    if (resultCode >= 0) {
+        printf("Checked %d files and %d directories with %d threads\n", result.files, result.directories, (int)threads);
+        printf("Mismatched FAT sectors     %8d\n", result.mismatchedSectors);
+        printf("Invalid chains             %8d\n", result.invalidChains);
+        printf("Cross-linked chains        %8d\n", result.crossLinked);
+        printf("Lost clusters              %8d\n", result.lostClusters);
+        printf("Size mismatches            %8d\n", result.sizeMismatches);
+    }
+
+    close_mapped_image(device);
+    free(ctx);
+    return resultCode == 0 ? 0 : 1;
+}
+
 /**
  * Main entry for program
  *
@@ -571,6 +1091,15 @@ int main(int argc, char** argv){
     if (strcmp(argv[1], "store") == 0)
          return main_store(argc - 2, argv + 2);
 
+    if (strcmp(argv[1], "remove") == 0)
+         return main_remove(argc - 2, argv + 2);
+
+    if (strcmp(argv[1], "defrag") == 0)
+         return main_defrag(argc - 2, argv + 2);
+
+    if (strcmp(argv[1], "check") == 0)
+         return main_check(argc - 2, argv + 2);
+
     printf("Unknown command '%s'\n", argv[1]);
     return print_help(1);
 }
\ No newline at end of file